@@ -6,6 +6,26 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // --------------------------- Book loading ---------------------------
 
@@ -45,7 +65,7 @@ static void load_book_from_disk(void) {
 }
 #endif
 
-// We will mutate the book during tokenization, so cast away const safely into a writable copy.
+// We sanitize the book in place before tokenization, so work on a writable copy.
 static char *book_mut = NULL;
 
 // Replace non-printable characters with spaces (keeps punctuation intact).
@@ -56,36 +76,192 @@ static void replace_non_printable_chars_with_space(void) {
   }
 }
 
+// Loads the book into book_mut with non-printable bytes blanked.
+static void load_book(void) {
+#if !(defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L)
+  load_book_from_disk();
+#endif
+
+  // Make a writable copy of the book content (sanitized in place below).
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L
+  size_t blen = strlen(book);
+  book_mut = (char *)malloc(blen + 1);
+  if (!book_mut) { fprintf(stderr, "OOM\n"); exit(1); }
+  memcpy(book_mut, book, blen + 1);
+#else
+  book_mut = (char *)malloc(strlen(book) + 1);
+  if (!book_mut) { fprintf(stderr, "OOM\n"); exit(1); }
+strcpy(book_mut, book);
+
+#endif
+
+  replace_non_printable_chars_with_space();
+}
+
+static void release_book(void) {
+  free(book_mut);
+  book_mut = NULL;
+#if !(defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L)
+  free(book_buf);
+  book_buf = NULL;
+#endif
+}
+
 // --------------------------- Token & successors ---------------------------
 
+// Byte classes shared by every tokenizer. Non-printable bytes count as space,
+// matching replace_non_printable_chars_with_space; ' and - stay inside a word
+// when a word character follows them ("don't", "post-road").
+enum { CC_WORD, CC_SPACE, CC_PUNCT, CC_INNER };
+
+#define CC_OF(c) ((c) <= ' ' || (c) >= 127 ? CC_SPACE                              \
+                  : (c) == '\'' || (c) == '-' ? CC_INNER                           \
+                  : ((c) >= '!' && (c) <= '/') || ((c) >= ':' && (c) <= '@') ||    \
+                    ((c) >= '[' && (c) <= '`') || ((c) >= '{' && (c) <= '~')       \
+                    ? CC_PUNCT : CC_WORD)
+#define FOLD_OF(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+#define LUT4(F, c) F(c), F((c) + 1), F((c) + 2), F((c) + 3)
+#define LUT16(F, c) LUT4(F, c), LUT4(F, (c) + 4), LUT4(F, (c) + 8), LUT4(F, (c) + 12)
+#define LUT64(F, c) LUT16(F, c), LUT16(F, (c) + 16), LUT16(F, (c) + 32), LUT16(F, (c) + 48)
+#define LUT256(F) LUT64(F, 0), LUT64(F, 64), LUT64(F, 128), LUT64(F, 192)
+
+static const unsigned char char_class[256] = { LUT256(CC_OF) };
+static const unsigned char fold_lut[256] = { LUT256(FOLD_OF) };
+
+
 // Upper bounds are guided by the novel size; we’ll grow dynamically where needed.
 #define HASH_SIZE 524287          // large-ish prime for open addressing
 #define INIT_SUCC_CAP 4
 
-static char **tokens = NULL;       // tokens[id] -> pointer into book_mut
+static char **tokens = NULL;       // tokens[id] -> interned key text
+static char **display = NULL;      // display[id] -> surface form to print (== tokens[id] unless folded)
 static size_t tokens_size = 0;
 static size_t tokens_cap = 0;
 
 static int *hash_index = NULL;     // hash table storing token ids (or -1 if empty)
 
-// For each token id, we store a dynamic array of successor pointers:
-static char ***succs = NULL;       // succs[id] -> array of char* (successor tokens)
+// For each token id, we store a dynamic array of successor ids (one per occurrence):
+static uint32_t **succs = NULL;    // succs[id] -> array of successor token ids
 static size_t *succs_sizes = NULL; // count of successors for token id
 static size_t *succs_caps = NULL;  // capacity of successor array for token id
 
+static bool fold_keys = false;      // key states by case-folded text (see key_hash)
+static bool bfs_layout = false;     // renumber states for walk locality (see layout_bfs)
+
+// Surface forms seen for a case-folded state, split by sentence position so
+// "The" can open sentences while "the" is used inside them.
+struct form_count {
+  const char *text;
+  uint32_t initial;  // occurrences at the start of a sentence
+  uint32_t other;
+};
+
+struct form_list {
+  struct form_count *v;
+  uint32_t n, cap;
+};
+
+static struct form_list *forms = NULL; // forms[id], only filled when fold_keys
+
+static uint32_t *token_freq = NULL; // occurrences of token id in the corpus
+static uint64_t corpus_tokens = 0;  // total tokens seen by the tokenizer
+static uint32_t *corpus_ids = NULL; // corpus_ids[i] -> id of the i-th corpus token
+static size_t corpus_cap = 0;
+
+static void *xmalloc(size_t n) {
+  void *p = malloc(n ? n : 1);
+  if (!p) { fprintf(stderr, "OOM\n"); exit(1); }
+  return p;
+}
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n ? n : 1);
+  if (!p) { fprintf(stderr, "OOM\n"); exit(1); }
+  return p;
+}
+
+// Offers e to a bounded min-heap of *n (at most cap) elements of `size` bytes,
+// so the heap keeps the cap best elements seen, worst at [0]. cmp orders the
+// elements as for qsort: cmp(a, b) < 0 when a ranks below b.
+static void heap_offer(void *heap, size_t *n, size_t cap, size_t size, const void *e,
+                       int (*cmp)(const void *, const void *)) {
+  if (cap == 0) return;
+  char *h = (char *)heap;
+  size_t i;
+  if (*n < cap) {
+    i = (*n)++;
+    while (i > 0 && cmp(e, h + (i - 1) / 2 * size) < 0) {
+      memcpy(h + i * size, h + (i - 1) / 2 * size, size);
+      i = (i - 1) / 2;
+    }
+  } else {
+    if (cmp(h, e) >= 0) return;
+    i = 0;
+    for (;;) {
+      size_t c = 2 * i + 1;
+      if (c >= *n) break;
+      if (c + 1 < *n && cmp(h + (c + 1) * size, h + c * size) < 0) ++c;
+      if (cmp(h + c * size, e) >= 0) break;
+      memcpy(h + i * size, h + c * size, size);
+      i = c;
+    }
+  }
+  memcpy(h + i * size, e, size);
+}
+
+// Token text is interned into large blocks that are never moved, since a
+// token may not be NUL-terminated where it sits in the corpus (e.g. "wretch"
+// in "wretch!" when punctuation is split off).
+#define ARENA_BLOCK ((size_t)1 << 20)
+
+struct arena {
+  char **blocks;
+  size_t n_blocks;
+  char *cur;
+  size_t left;
+};
+
+static struct arena token_pool;    // owns the text of tokens[] and display[]
+
+static char *arena_strndup(struct arena *a, const char *s, size_t len) {
+  if (len + 1 > a->left) {
+    size_t size = len + 1 > ARENA_BLOCK ? len + 1 : ARENA_BLOCK;
+    a->blocks = (char **)xrealloc(a->blocks, (a->n_blocks + 1) * sizeof(char *));
+    a->cur = a->blocks[a->n_blocks++] = (char *)xmalloc(size);
+    a->left = size;
+  }
+  char *p = a->cur;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  a->cur += len + 1;
+  a->left -= len + 1;
+  return p;
+}
+
+static void arena_free(struct arena *a) {
+  for (size_t i = 0; i < a->n_blocks; ++i) free(a->blocks[i]);
+  free(a->blocks);
+  memset(a, 0, sizeof *a);
+}
+
 static void ensure_tokens_capacity(void) {
   if (tokens_size >= tokens_cap) {
     size_t new_cap = tokens_cap ? tokens_cap * 2 : 32768;
     tokens = (char **)realloc(tokens, new_cap * sizeof(char *));
-    succs = (char ***)realloc(succs, new_cap * sizeof(char **));
+    display = (char **)realloc(display, new_cap * sizeof(char *));
+    succs = (uint32_t **)realloc(succs, new_cap * sizeof(uint32_t *));
     succs_sizes = (size_t *)realloc(succs_sizes, new_cap * sizeof(size_t));
     succs_caps  = (size_t *)realloc(succs_caps,  new_cap * sizeof(size_t));
-    if (!tokens || !succs || !succs_sizes || !succs_caps) { fprintf(stderr, "OOM\n"); exit(1); }
+    token_freq = (uint32_t *)realloc(token_freq, new_cap * sizeof(uint32_t));
+    forms = (struct form_list *)realloc(forms, new_cap * sizeof(struct form_list));
+    if (!tokens || !display || !succs || !succs_sizes || !succs_caps || !token_freq || !forms) { fprintf(stderr, "OOM\n"); exit(1); }
     // Initialize new ranges
     for (size_t i = tokens_cap; i < new_cap; ++i) {
       succs[i] = NULL;
       succs_sizes[i] = 0;
       succs_caps[i] = 0;
+      token_freq[i] = 0;
+      forms[i] = (struct form_list){0};
     }
     tokens_cap = new_cap;
   }
@@ -101,19 +277,94 @@ static unsigned long hash_str(const char *s) {
   return h;
 }
 
+// Same recurrence as hash_str, for token spans that are not NUL-terminated.
+static unsigned long hash_mem(const char *s, size_t n) {
+  unsigned long h = 5381UL;
+  for (size_t i = 0; i < n; ++i) {
+    h = ((h << 5) + h) ^ (unsigned long)(unsigned char)s[i];
+  }
+  return h;
+}
+
+// Folded states store their key lowercased. Lookups fold the probed span on
+// the fly while hashing and comparing, so no folded copy is ever made; since
+// folding is idempotent, hash_str(key) == hash_mem_fold(any spelling of it).
+static unsigned long hash_mem_fold(const char *s, size_t n) {
+  unsigned long h = 5381UL;
+  for (size_t i = 0; i < n; ++i) {
+    h = ((h << 5) + h) ^ (unsigned long)fold_lut[(unsigned char)s[i]];
+  }
+  return h;
+}
+
+#ifdef __SSE2__
+// ASCII case fold of 16 bytes: bytes in 'A'..'Z' get 0x20 added. Bytes >= 0x80
+// compare as negative and are left alone.
+static inline __m128i fold16(__m128i v) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+  return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+static void fold_bytes(char *dst, const char *src, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(dst + i), fold16(_mm_loadu_si128((const __m128i *)(src + i))));
+  }
+#endif
+  for (; i < len; ++i) dst[i] = (char)fold_lut[(unsigned char)src[i]];
+}
+
+// Does the lowercased key equal s[0..len) after folding?
+static bool folded_equal(const char *key, const char *s, size_t len) {
+  if (strnlen(key, len + 1) != len) return false;
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(key + i));
+    __m128i b = fold16(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) return false;
+  }
+#endif
+  for (; i < len; ++i) {
+    if (key[i] != (char)fold_lut[(unsigned char)s[i]]) return false;
+  }
+  return true;
+}
+
+static inline unsigned long key_hash(bool fold, const char *s, size_t len) {
+  return fold ? hash_mem_fold(s, len) : hash_mem(s, len);
+}
+
+static inline bool key_equal(bool fold, const char *key, const char *s, size_t len) {
+  return fold ? folded_equal(key, s, len) : strncmp(key, s, len) == 0 && key[len] == '\0';
+}
+
+// Final avalanche (MurmurHash3 fmix64) so the table index uses all the bits.
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h ? h : 1;
+}
+
 static void hash_init(void) {
   hash_index = (int *)malloc(HASH_SIZE * sizeof(int));
   if (!hash_index) { fprintf(stderr, "OOM\n"); exit(1); }
   for (size_t i = 0; i < HASH_SIZE; ++i) hash_index[i] = -1;
 }
 
-static int hash_find(const char *s) {
-  unsigned long h = hash_str(s) % HASH_SIZE;
+static int hash_find(const char *s, size_t len) {
+  unsigned long h = key_hash(fold_keys, s, len) % HASH_SIZE;
   for (size_t probe = 0; probe < HASH_SIZE; ++probe) {
     size_t i = (h + probe) % HASH_SIZE;
     int id = hash_index[i];
     if (id == -1) return -1;            // empty
-    if (tokens[id] && strcmp(tokens[id], s) == 0) return id;
+    if (tokens[id] && key_equal(fold_keys, tokens[id], s, len)) return id;
   }
   return -1; // table full (shouldn’t happen)
 }
@@ -131,178 +382,5252 @@ static void hash_insert(const char *s, int id) {
   exit(1);
 }
 
-// Returns id for token, creating a new id if needed.
-static size_t token_id(const char *tok) {
-  int found = hash_find(tok);
+// Returns id for the token text s[0..len), interning it if it is new.
+static size_t token_id(const char *s, size_t len) {
+  int found = hash_find(s, len);
   if (found >= 0) return (size_t)found;
 
   ensure_tokens_capacity();
   size_t id = tokens_size++;
-  tokens[id] = (char *)tok;
+  char *tok = arena_strndup(&token_pool, s, len);
+  if (fold_keys) fold_bytes(tok, tok, len);
+  tokens[id] = tok;
+  display[id] = tok;
 
   // initialize successor lists for this id
   succs[id] = NULL;
   succs_sizes[id] = 0;
   succs_caps[id] = 0;
+  token_freq[id] = 0;
 
   hash_insert(tok, (int)id);
   return id;
 }
 
-static void append_to_succs(const char *prev, const char *curr) {
-  size_t pid = token_id(prev);
-  // We store successor POINTERS (curr points into book_mut)
+static void append_to_succs(size_t pid, size_t cid) {
   if (succs_caps[pid] == 0) {
     succs_caps[pid] = INIT_SUCC_CAP;
-    succs[pid] = (char **)malloc(succs_caps[pid] * sizeof(char *));
+    succs[pid] = (uint32_t *)malloc(succs_caps[pid] * sizeof(uint32_t));
     if (!succs[pid]) { fprintf(stderr, "OOM\n"); exit(1); }
   } else if (succs_sizes[pid] >= succs_caps[pid]) {
     succs_caps[pid] *= 2;
-    succs[pid] = (char **)realloc(succs[pid], succs_caps[pid] * sizeof(char *));
+    succs[pid] = (uint32_t *)realloc(succs[pid], succs_caps[pid] * sizeof(uint32_t));
     if (!succs[pid]) { fprintf(stderr, "OOM\n"); exit(1); }
   }
-  succs[pid][succs_sizes[pid]++] = (char *)curr;
+  succs[pid][succs_sizes[pid]++] = (uint32_t)cid;
 }
 
 // --------------------------- Tokenization ---------------------------
 
-static void tokenize_and_fill_succs(char *delimiters, char *str) {
-  // Reset sizes (safe even on first call as we malloc zeros via ensure)
-  // We don't clear tokens table here; token_id grows as we encounter new tokens.
-  char *saveptr = NULL;
-  char *prev = NULL;
-  char *tok = strtok_r(str, delimiters, &saveptr);
-  while (tok) {
-    token_id(tok);
-    if (prev) append_to_succs(prev, tok);
-    prev = tok;
-    tok = strtok_r(NULL, delimiters, &saveptr);
+struct span {
+  const char *p;
+  size_t len;
+};
+
+static inline bool is_delim(unsigned char c) {
+  return char_class[c] == CC_SPACE;
+}
+
+// How rendering joins consecutive tokens.
+enum join_rule {
+  JOIN_SPACE,  // always one space
+  JOIN_PUNCT,  // one space, except before closing punctuation
+  JOIN_NONE,   // tokens carry their own spacing (character-level)
+};
+
+// A tokenizer turns text into token spans. next() never modifies the text;
+// the span is the surface form as written. When fold is set, states are
+// keyed by the lowercased form and the surface form is kept for display.
+struct tokenizer {
+  const char *name;
+  bool (*next)(const char **cur, const char *end, struct span *out);
+  bool fold;
+  enum join_rule join;
+};
+
+// Whitespace only, so punctuation sticks to tokens ("wretch!").
+static bool next_whitespace_token(const char **cur, const char *end, struct span *out) {
+  const char *p = *cur;
+  while (p < end && is_delim((unsigned char)*p)) ++p;
+  if (p == end) { *cur = p; return false; }
+  const char *q = p;
+  while (q < end && !is_delim((unsigned char)*q)) ++q;
+  out->p = p;
+  out->len = (size_t)(q - p);
+  *cur = q;
+  return true;
+}
+
+// Words and punctuation runs ("wretch", "!"), splitting on whitespace too.
+static bool next_punct_token(const char **cur, const char *end, struct span *out) {
+  const char *p = *cur;
+  while (p < end && is_delim((unsigned char)*p)) ++p;
+  if (p == end) { *cur = p; return false; }
+  const char *q = p + 1;
+  unsigned char c0 = char_class[(unsigned char)*p];
+  if (c0 == CC_WORD) {
+    while (q < end) {
+      unsigned char c = char_class[(unsigned char)*q];
+      if (c == CC_WORD) ++q;
+      else if (c == CC_INNER && q + 1 < end && char_class[(unsigned char)q[1]] == CC_WORD) q += 2;
+      else break;
+    }
+  } else {
+    while (q < end && *q == *p) ++q; // "...", "--", "***" stay one token
   }
+  out->p = p;
+  out->len = (size_t)(q - p);
+  *cur = q;
+  return true;
 }
 
-// --------------------------- Sentence generation ---------------------------
+// One token per byte; each run of whitespace becomes a single " " token.
+static bool next_char_token(const char **cur, const char *end, struct span *out) {
+  const char *p = *cur;
+  if (p == end) return false;
+  if (is_delim((unsigned char)*p)) {
+    while (p < end && is_delim((unsigned char)*p)) ++p;
+    out->p = " ";
+    out->len = 1;
+  } else {
+    out->p = p++;
+    out->len = 1;
+  }
+  *cur = p;
+  return true;
+}
+
+static const struct tokenizer tokenizers[] = {
+  { "whitespace", next_whitespace_token, false, JOIN_SPACE },
+  { "punct",      next_punct_token,      false, JOIN_PUNCT },
+  { "fold",       next_punct_token,      true,  JOIN_PUNCT },
+  { "char",       next_char_token,       false, JOIN_NONE  },
+};
+
+static const struct tokenizer *find_tokenizer(const char *name) {
+  for (size_t i = 0; i < sizeof tokenizers / sizeof tokenizers[0]; ++i) {
+    if (strcmp(tokenizers[i].name, name) == 0) return &tokenizers[i];
+  }
+  return NULL;
+}
+
+// Counts the surface form of a folded state. Forms of one state are few, so
+// a linear scan of its list beats a global table.
+static void record_form(size_t id, struct span sp, bool initial) {
+  struct form_list *fl = &forms[id];
+  struct form_count *fc = NULL;
+  for (uint32_t i = 0; i < fl->n; ++i) {
+    if (strncmp(fl->v[i].text, sp.p, sp.len) == 0 && fl->v[i].text[sp.len] == '\0') { fc = &fl->v[i]; break; }
+  }
+  if (!fc) {
+    if (fl->n == fl->cap) {
+      fl->cap = fl->cap ? fl->cap * 2 : 2;
+      fl->v = (struct form_count *)xrealloc(fl->v, fl->cap * sizeof(struct form_count));
+    }
+    fc = &fl->v[fl->n++];
+    *fc = (struct form_count){ arena_strndup(&token_pool, sp.p, sp.len), 0, 0 };
+  }
+  if (initial) fc->initial++;
+  else fc->other++;
+}
 
 static char last_char(const char *s) {
   size_t n = strlen(s);
   return n ? s[n - 1] : '\0';
 }
 
-static bool token_ends_a_sentence(const char *token) {
-  char c = last_char(token);
+static bool is_terminal_char(char c) {
   return c == '.' || c == '?' || c == '!';
 }
 
-static size_t random_token_id_that_starts_a_sentence(void) {
-  // Try random picks first
-  for (int attempts = 0; attempts < 10000; ++attempts) {
-    if (tokens_size == 0) break;
-    size_t i = (size_t)(rand() % (int)tokens_size);
-    unsigned char c0 = (unsigned char)tokens[i][0];
-    if (isalpha(c0) && isupper(c0)) return i;
-  }
-  // Fallback: first capitalized token
-  for (size_t i = 0; i < tokens_size; ++i) {
-    unsigned char c0 = (unsigned char)tokens[i][0];
-    if (isalpha(c0) && isupper(c0)) return i;
+static bool token_ends_a_sentence(const char *token) {
+  return is_terminal_char(last_char(token));
+}
+
+static void tokenize_and_fill_succs(const struct tokenizer *t, const char *text, size_t len) {
+  // We don't clear tokens table here; token_id grows as we encounter new tokens.
+  const char *cur = text, *end = text + len;
+  size_t prev = SIZE_MAX;
+  struct span sp;
+  while (t->next(&cur, end, &sp)) {
+    size_t id = token_id(sp.p, sp.len);
+    if (fold_keys) record_form(id, sp, prev == SIZE_MAX || token_ends_a_sentence(tokens[prev]));
+    token_freq[id]++;
+    if (corpus_tokens == corpus_cap) {
+      corpus_cap = corpus_cap ? corpus_cap * 2 : 65536;
+      corpus_ids = (uint32_t *)xrealloc(corpus_ids, corpus_cap * sizeof(uint32_t));
+    }
+    corpus_ids[corpus_tokens++] = (uint32_t)id;
+    if (prev != SIZE_MAX) append_to_succs(prev, id);
+    prev = id;
   }
-  return 0;
 }
 
-static char *generate_sentence(char *out, size_t out_size) {
-  if (out_size == 0) return out;
-  out[0] = '\0';
+// --------------------------- Shared vocabulary ---------------------------
 
-  size_t start_id = random_token_id_that_starts_a_sentence();
-  const char *token = tokens_size ? tokens[start_id] : "";
-  strncat(out, token, out_size - 1);
-  if (token_ends_a_sentence(token)) return out;
+// A vocabulary snapshot holds the keys of many models under global ids so the
+// models can drop their own key text and hash tables (see share_vocab). It is
+// written once by `frankentext vocab` and mapped read-only, so every process
+// using it shares one copy through the page cache.
+//
+// Keys are found with a CHD-style perfect hash: a key's 64-bit hash picks a
+// bucket, the bucket's displacement picks its slot, and every slot holds at
+// most one key, so a lookup is one probe and one string compare.
+//
+// File layout: struct vocab_header, uint64 key offsets (n), uint32
+// displacements (n_buckets), uint32 slots (table_size, UINT32_MAX = empty),
+// then the NUL-terminated keys.
+#define VOCAB_MAGIC "FTVOC001"
 
-  while (strlen(out) + 2 < out_size) {
-    size_t curr_id = token_id(token);
-    size_t nsucc = succs_sizes[curr_id];
-    if (nsucc == 0) break; // dead end
+struct vocab_header {
+  char magic[8];
+  uint32_t fold;        // keys are case-folded
+  uint32_t tokenizer;   // index into tokenizers[]
+  uint64_t n;           // keys
+  uint64_t n_buckets;
+  uint64_t table_size;
+  uint64_t text_bytes;
+};
 
-    const char *next = succs[curr_id][rand() % nsucc];
+struct vocab {
+  void *map;
+  size_t map_size;
+  bool fold;
+  uint32_t tokenizer;
+  size_t n, n_buckets, table_size;
+  const uint64_t *key_off;
+  const uint32_t *disp;
+  const uint32_t *slot;
+  const char *text;
+};
 
-    size_t need = strlen(out) + 1 + strlen(next) + 1;
-    if (need >= out_size) break;
+static inline const char *vocab_key(const struct vocab *v, size_t g) {
+  return v->text + v->key_off[g];
+}
 
-    strcat(out, " ");
-    strcat(out, next);
-    token = next;
-    if (token_ends_a_sentence(token)) break;
-  }
-  return out;
+static inline size_t vocab_bucket(uint64_t h, size_t n_buckets) {
+  return (size_t)(((h >> 32) * (uint64_t)n_buckets) >> 32);
 }
 
-static bool ends_with_char(const char *s, char c) {
-  return last_char(s) == c;
+static inline size_t vocab_slot(uint64_t h, uint32_t d, size_t table_size) {
+  return (size_t)(mix64(h + (uint64_t)d * 0x9E3779B97F4A7C15ULL) % table_size);
 }
 
-// --------------------------- Main ---------------------------
+// Global id of the span s[0..len), or -1.
+static int64_t vocab_lookup(const struct vocab *v, const char *s, size_t len) {
+  if (v->n == 0) return -1;
+  uint64_t h = mix64(key_hash(v->fold, s, len));
+  uint32_t g = v->slot[vocab_slot(h, v->disp[vocab_bucket(h, v->n_buckets)], v->table_size)];
+  if (g == UINT32_MAX || !key_equal(v->fold, vocab_key(v, g), s, len)) return -1;
+  return g;
+}
 
-int main(void) {
-  srand((unsigned)time(NULL));
+// --------------------------- Frozen model ---------------------------
 
-#if !(defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L)
-  load_book_from_disk();
-#endif
+// After tokenization the builder's growable per-token arrays are frozen into
+// flat CSR rows. Generation and scoring only read the model, so it can be
+// shared by any number of threads.
 
-  // Make a writable copy of the book content (we’ll mutate with strtok_r).
-#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L
-  size_t blen = strlen(book);
-  book_mut = (char *)malloc(blen + 1);
-  if (!book_mut) { fprintf(stderr, "OOM\n"); return 1; }
-  memcpy(book_mut, book, blen + 1);
-#else
-  book_mut = (char *)malloc(strlen(book) + 1);
-  if (!book_mut) { fprintf(stderr, "OOM\n"); return 1; }
-strcpy(book_mut, book);
+// What a walk step reads about a state, in one 16-byte record so a cache
+// line holds four states. Everything else about a state (key text, surface
+// forms, frequency) lives in separate cold arrays.
+struct state_hot {
+  uint32_t occ;    // occurrences in occ_id[occ, occ + n_occ), or the successor if STATE_FIXED
+  uint32_t n_occ;  // row total
+  uint32_t row;    // distinct successors from succ_id[row]; alias tables are built from these
+  uint8_t end;     // last character if the token ends a sentence, else 0
+  uint8_t flags;   // STATE_* below
+  uint16_t len;    // key length (every surface form has it), UINT16_MAX if longer
+};
 
-#endif
+_Static_assert(sizeof(struct state_hot) == 16, "four hot states per cache line");
 
-  replace_non_printable_chars_with_space();
+enum {
+  STATE_START = 1,  // has a capitalized surface form
+  STATE_OPENS = 2,  // starts with an opening bracket: no space after it (JOIN_PUNCT)
+  STATE_CLOSES = 4, // starts with closing punctuation: no space before it (JOIN_PUNCT)
+  STATE_FIXED = 8,  // exactly one distinct successor, stored in occ: no row load, no draw
+};
 
-  // Init structures
-  hash_init();
-  ensure_tokens_capacity(); // allocate initial blocks
+// One step over the deterministic chain through a state: the rendered rest
+// of its unitig (see build_macros), emitted with a single copy.
+struct macro_step {
+  uint32_t text;   // offset in macro_text; NUL-terminated, separators included
+  uint32_t ids;    // offset in macro_ids of the states it emits
+  uint32_t n;      // states emitted (0: no chain through this state)
+  uint32_t bytes;  // strlen of the text
+};
 
-  // Tokenize on spaces/newlines only so punctuation sticks to tokens.
-  tokenize_and_fill_succs(" \n\r", book_mut);
+struct model {
+  const struct tokenizer *tok;
+  struct arena pool;      // owns all token text
+  char **tokens;          // tokens[id] -> NUL-terminated key text
+  char **display;         // display[id] -> surface form for output (most frequent one if folded)
+  bool fold;              // states are keyed by case-folded text
+  struct state_hot *hot;  // hot[id]; see struct state_hot
+  // Folded models only: the surface forms of id, most frequent first, in
+  // [form_off[id], form_off[id + 1]), with counts by sentence position.
+  uint32_t *form_off;
+  char **form_text;
+  uint32_t *form_initial;
+  uint32_t *form_other;
+  int *hash_index;        // HASH_SIZE open-addressing slots holding token ids (NULL if shared)
+  // Set by share_vocab: tokens[] then point into the shared dictionary and
+  // lookups go through it. global[id] is the global id of id; by_global lists
+  // the ids sorted by global id, to map a global id back.
+  const struct vocab *vocab;
+  uint32_t *global;
+  uint32_t *by_global;
+  size_t n_states;
+  uint64_t n_tokens;      // corpus length in tokens
+  uint32_t *corpus;       // the corpus as a token id sequence (n_tokens entries)
+  uint32_t *freq;         // freq[id] -> occurrences of id in the corpus
+  // Distinct successors of id, sorted by id: [row_off[id], row_off[id + 1]).
+  uint32_t *row_off;
+  uint32_t *succ_id;
+  uint32_t *succ_count;
+  // Every observed transition of id in corpus order: [occ_off[id], occ_off[id + 1]).
+  // Sampling a uniform entry is sampling proportionally to the counts.
+  uint32_t *occ_off;
+  uint32_t *occ_id;
+  // Set when the model was mapped from a snapshot (see open_snapshot): the
+  // arrays point into the mapping, corpus and occ_id are NULL, and rows are
+  // sampled through alias tables that `sampler` builds on first visit.
+  void *map;
+  size_t map_size;
+  struct temper *sampler;
+  // Unitig compression, for models built from text without case folding
+  // (folded models sample a surface form per token, which a pre-rendered
+  // chain cannot) or a shared vocabulary (see prerender_model): macro[id]
+  // when hot[id] is STATE_FIXED; NULL otherwise.
+  struct macro_step *macro;
+  char *macro_text;
+  uint32_t *macro_ids;
+  // Pre-rendered output, for the same models: display[id] points into this
+  // pool right after a space, so display[id] - 1 is " token" and a token and
+  // its separator are one copy of known length. Both this pool and
+  // macro_text end with RENDER_SLACK spare bytes for vector copies.
+  char *render;
+};
 
-  // Generate a question sentence and an exclamation sentence.
-  // Keep sampling until the final char matches the desired punctuation.
-  char buf[4096];
+static struct model model;
 
-  // Question
-  for (int tries = 0; tries < 1000; ++tries) {
-    generate_sentence(buf, sizeof buf);
-    if (ends_with_char(buf, '?')) {
-      printf("%s\n\n", buf);
-      break;
+static int cmp_form_desc(const void *a, const void *b) {
+  const struct form_count *x = (const struct form_count *)a, *y = (const struct form_count *)b;
+  uint64_t cx = (uint64_t)x->initial + x->other, cy = (uint64_t)y->initial + y->other;
+  return (cx < cy) - (cx > cy);
+}
+
+static bool capitalized(const char *s) {
+  unsigned char c0 = (unsigned char)s[0];
+  return isalpha(c0) && isupper(c0);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Orders state ids by descending frequency (arg), then by id.
+static int cmp_freq_desc(const void *a, const void *b, void *arg) {
+  const uint32_t *freq = (const uint32_t *)arg;
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  if (freq[x] != freq[y]) return freq[x] < freq[y] ? 1 : -1;
+  return (x > y) - (x < y);
+}
+
+static struct state_hot state_hot_of(const struct model *m, size_t id, bool start) {
+  const char *key = m->tokens[id];
+  size_t len = strlen(key);
+  struct state_hot h = { m->occ_off[id], m->occ_off[id + 1] - m->occ_off[id], m->row_off[id], 0, 0,
+                         (uint16_t)(len < UINT16_MAX ? len : UINT16_MAX) };
+  if (len && is_terminal_char(key[len - 1])) h.end = (uint8_t)key[len - 1];
+  if (start) h.flags |= STATE_START;
+  if (m->row_off[id + 1] - m->row_off[id] == 1) { h.flags |= STATE_FIXED; h.occ = m->succ_id[m->row_off[id]]; }
+  if (key[0] && strchr("([{", key[0])) h.flags |= STATE_OPENS;
+  if (key[0] && strchr(".,;:!?)]}", key[0])) h.flags |= STATE_CLOSES;
+  return h;
+}
+
+// Moves the builder state into m and releases the per-token successor lists.
+static void freeze_model(struct model *m) {
+  size_t n = tokens_size;
+  m->pool = token_pool;
+  m->tokens = tokens;
+  m->display = display;
+  m->fold = fold_keys;
+  uint8_t *starts = (uint8_t *)xmalloc(n ? n : 1);
+  for (size_t i = 0; i < n; ++i) starts[i] = capitalized(tokens[i]);
+  if (fold_keys) {
+    size_t n_forms = 0;
+    for (size_t i = 0; i < n; ++i) n_forms += forms[i].n;
+    m->form_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+    m->form_text = (char **)xmalloc(n_forms * sizeof(char *));
+    m->form_initial = (uint32_t *)xmalloc(n_forms * sizeof(uint32_t));
+    m->form_other = (uint32_t *)xmalloc(n_forms * sizeof(uint32_t));
+    uint32_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+      struct form_list *fl = &forms[i];
+      qsort(fl->v, fl->n, sizeof(struct form_count), cmp_form_desc);
+      m->form_off[i] = k;
+      for (uint32_t j = 0; j < fl->n; ++j, ++k) {
+        m->form_text[k] = (char *)fl->v[j].text;
+        m->form_initial[k] = fl->v[j].initial;
+        m->form_other[k] = fl->v[j].other;
+        if (capitalized(fl->v[j].text)) starts[i] = 1;
+      }
+      if (fl->n) display[i] = (char *)fl->v[0].text;
     }
+    m->form_off[n] = k;
   }
+  for (size_t i = 0; i < tokens_cap; ++i) free(forms[i].v);
+  free(forms);
+  forms = NULL;
+  m->hash_index = hash_index;
+  m->n_states = n;
+  m->n_tokens = corpus_tokens;
+  m->corpus = corpus_ids;
+  m->freq = token_freq;
 
-  // Exclamation
-  for (int tries = 0; tries < 1000; ++tries) {
-    generate_sentence(buf, sizeof buf);
-    if (ends_with_char(buf, '!')) {
-      printf("%s\n", buf);
-      break;
+  uint64_t total = 0;
+  size_t widest = 0;
+  m->occ_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < n; ++i) {
+    m->occ_off[i] = (uint32_t)total;
+    total += succs_sizes[i];
+    if (succs_sizes[i] > widest) widest = succs_sizes[i];
+  }
+  if (total > UINT32_MAX) { fprintf(stderr, "Corpus too large for 32-bit rows\n"); exit(1); }
+  m->occ_off[n] = (uint32_t)total;
+  m->occ_id = (uint32_t *)xmalloc(total * sizeof(uint32_t));
+
+  // Distinct rows: sort a scratch copy of each occurrence list and collapse runs.
+  uint32_t *scratch = (uint32_t *)xmalloc(widest * sizeof(uint32_t));
+  m->row_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  m->succ_id = (uint32_t *)xmalloc(total * sizeof(uint32_t));
+  m->succ_count = (uint32_t *)xmalloc(total * sizeof(uint32_t));
+  uint32_t distinct = 0;
+  for (size_t i = 0; i < n; ++i) {
+    size_t k = succs_sizes[i];
+    m->row_off[i] = distinct;
+    if (k) memcpy(m->occ_id + m->occ_off[i], succs[i], k * sizeof(uint32_t));
+    if (k) memcpy(scratch, succs[i], k * sizeof(uint32_t));
+    qsort(scratch, k, sizeof(uint32_t), cmp_u32);
+    for (size_t j = 0; j < k; ++j) {
+      if (j == 0 || scratch[j] != scratch[j - 1]) {
+        m->succ_id[distinct] = scratch[j];
+        m->succ_count[distinct++] = 0;
+      }
+      m->succ_count[distinct - 1]++;
     }
+    free(succs[i]);
   }
+  m->row_off[n] = distinct;
+  m->succ_id = (uint32_t *)xrealloc(m->succ_id, distinct * sizeof(uint32_t));
+  m->succ_count = (uint32_t *)xrealloc(m->succ_count, distinct * sizeof(uint32_t));
+  free(scratch);
+  m->hot = (struct state_hot *)xmalloc((n ? n : 1) * sizeof(struct state_hot));
+  for (size_t i = 0; i < n; ++i) m->hot[i] = state_hot_of(m, i, starts[i]);
+  free(starts);
 
-  // Cleanup (optional in short-lived program)
-  free(book_mut);
-#if !(defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L)
-  free(book_buf);
-#endif
-  free(hash_index);
-  for (size_t i = 0; i < tokens_size; ++i) free(succs[i]);
   free(succs);
   free(succs_sizes);
   free(succs_caps);
-  free(tokens);
+  memset(&token_pool, 0, sizeof token_pool);
+  tokens = NULL;
+  display = NULL;
+  hash_index = NULL;
+  succs = NULL;
+  succs_sizes = NULL;
+  succs_caps = NULL;
+  token_freq = NULL;
+  corpus_ids = NULL;
+  tokens_size = tokens_cap = 0;
+  corpus_tokens = 0;
+  corpus_cap = 0;
+}
 
-  return 0;
+// Renumbers the states of a frozen model: order[new] is the old id of state
+// new. Every id-indexed array and every stored id is rewritten; rows keep
+// their successors sorted by (new) id and their occurrences in corpus order.
+static void permute_model(struct model *m, const uint32_t *order) {
+  size_t n = m->n_states;
+  uint32_t *renum = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  for (size_t r = 0; r < n; ++r) renum[order[r]] = (uint32_t)r;
+
+  char **tokens_new = (char **)xmalloc((n ? n : 1) * sizeof(char *));
+  char **display_new = (char **)xmalloc((n ? n : 1) * sizeof(char *));
+  struct state_hot *hot_new = (struct state_hot *)xmalloc((n ? n : 1) * sizeof(struct state_hot));
+  uint32_t *freq_new = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  for (size_t r = 0; r < n; ++r) {
+    tokens_new[r] = m->tokens[order[r]];
+    display_new[r] = m->display[order[r]];
+    hot_new[r] = m->hot[order[r]]; // offsets are fixed up with the rows below
+    freq_new[r] = m->freq[order[r]];
+  }
+  free(m->tokens);
+  free(m->display);
+  free(m->hot);
+  free(m->freq);
+  m->tokens = tokens_new;
+  m->display = display_new;
+  m->hot = hot_new;
+  m->freq = freq_new;
+
+  if (m->form_off) {
+    size_t n_forms = m->form_off[n];
+    uint32_t *off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+    char **text = (char **)xmalloc((n_forms ? n_forms : 1) * sizeof(char *));
+    uint32_t *initial = (uint32_t *)xmalloc((n_forms ? n_forms : 1) * sizeof(uint32_t));
+    uint32_t *other = (uint32_t *)xmalloc((n_forms ? n_forms : 1) * sizeof(uint32_t));
+    uint32_t k = 0;
+    for (size_t r = 0; r < n; ++r) {
+      off[r] = k;
+      for (uint32_t j = m->form_off[order[r]]; j < m->form_off[order[r] + 1]; ++j, ++k) {
+        text[k] = m->form_text[j];
+        initial[k] = m->form_initial[j];
+        other[k] = m->form_other[j];
+      }
+    }
+    off[n] = k;
+    free(m->form_off);
+    free(m->form_text);
+    free(m->form_initial);
+    free(m->form_other);
+    m->form_off = off;
+    m->form_text = text;
+    m->form_initial = initial;
+    m->form_other = other;
+  }
+  if (m->hash_index) {
+    for (size_t i = 0; i < HASH_SIZE; ++i) {
+      if (m->hash_index[i] >= 0) m->hash_index[i] = (int)renum[m->hash_index[i]];
+    }
+  }
+  for (size_t i = 0; i < m->n_tokens; ++i) m->corpus[i] = renum[m->corpus[i]];
+
+  size_t edges = m->row_off[n], widest = 0;
+  uint32_t *row_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  uint32_t *succ_id = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+  uint32_t *succ_count = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+  uint32_t *occ_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  uint32_t *occ_id = (uint32_t *)xmalloc((m->occ_off[n] ? m->occ_off[n] : 1) * sizeof(uint32_t));
+  for (size_t v = 0; v < n; ++v) {
+    size_t k = m->row_off[v + 1] - m->row_off[v];
+    if (k > widest) widest = k;
+  }
+  uint64_t *row = (uint64_t *)xmalloc((widest ? widest : 1) * sizeof(uint64_t));
+  uint32_t e = 0, o = 0;
+  for (size_t r = 0; r < n; ++r) {
+    size_t v = order[r], lo = m->row_off[v], k = m->row_off[v + 1] - lo;
+    row_off[r] = e;
+    for (size_t j = 0; j < k; ++j) row[j] = (uint64_t)renum[m->succ_id[lo + j]] << 32 | m->succ_count[lo + j];
+    qsort(row, k, sizeof(uint64_t), cmp_u64);
+    for (size_t j = 0; j < k; ++j, ++e) { succ_id[e] = (uint32_t)(row[j] >> 32); succ_count[e] = (uint32_t)row[j]; }
+    occ_off[r] = o;
+    for (uint32_t j = m->occ_off[v]; j < m->occ_off[v + 1]; ++j) occ_id[o++] = renum[m->occ_id[j]];
+    m->hot[r].occ = m->hot[r].flags & STATE_FIXED ? succ_id[row_off[r]] : occ_off[r];
+    m->hot[r].row = row_off[r];
+  }
+  row_off[n] = e;
+  occ_off[n] = o;
+  free(row);
+  free(m->row_off);
+  free(m->succ_id);
+  free(m->succ_count);
+  free(m->occ_off);
+  free(m->occ_id);
+  m->row_off = row_off;
+  m->succ_id = succ_id;
+  m->succ_count = succ_count;
+  m->occ_off = occ_off;
+  m->occ_id = occ_id;
+  free(renum);
+}
+
+// Cuthill-McKee style layout for walks: breadth-first from the most frequent
+// unvisited state, expanding each row's successors most likely first, so a
+// state's likely successors get nearby ids and so nearby row offsets, flags
+// and rows. (Reversing the order, as RCM does, only matters for the bandwidth
+// of symmetric matrices; walks follow edges forwards.)
+static void layout_bfs(struct model *m) {
+  size_t n = m->n_states, widest = 0;
+  uint32_t *roots = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *order = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint8_t *seen = (uint8_t *)calloc(n ? n : 1, 1);
+  if (!seen) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (size_t v = 0; v < n; ++v) {
+    roots[v] = (uint32_t)v;
+    size_t k = m->row_off[v + 1] - m->row_off[v];
+    if (k > widest) widest = k;
+  }
+  qsort_r(roots, n, sizeof(uint32_t), cmp_freq_desc, m->freq);
+  uint64_t *row = (uint64_t *)xmalloc((widest ? widest : 1) * sizeof(uint64_t));
+  size_t head = 0, tail = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (seen[roots[i]]) continue;
+    seen[roots[i]] = 1;
+    order[tail++] = roots[i];
+    while (head < tail) {
+      uint32_t v = order[head++], lo = m->row_off[v], k = m->row_off[v + 1] - lo;
+      // Most likely first, ties by id: sort on (~count, id).
+      for (uint32_t j = 0; j < k; ++j) row[j] = (uint64_t)(UINT32_MAX - m->succ_count[lo + j]) << 32 | m->succ_id[lo + j];
+      qsort(row, k, sizeof(uint64_t), cmp_u64);
+      for (uint32_t j = 0; j < k; ++j) {
+        uint32_t w = (uint32_t)row[j];
+        if (!seen[w]) { seen[w] = 1; order[tail++] = w; }
+      }
+    }
+  }
+  free(row);
+  free(seen);
+  free(roots);
+  permute_model(m, order);
+  free(order);
+}
+
+static void free_model(struct model *m) {
+  free(m->hash_index);
+  free(m->global);
+  free(m->by_global);
+  free(m->tokens);
+  free(m->display);
+  free(m->hot);
+  free(m->form_off);
+  free(m->form_text);
+  free(m->form_initial);
+  free(m->form_other);
+  arena_free(&m->pool);
+  free(m->freq);
+  free(m->corpus);
+  free(m->row_off);
+  free(m->succ_id);
+  free(m->succ_count);
+  free(m->occ_off);
+  free(m->occ_id);
+  free(m->macro);
+  free(m->macro_text);
+  free(m->macro_ids);
+  free(m->render);
+  memset(m, 0, sizeof *m);
+}
+
+static inline uint32_t row_total(const struct model *m, size_t id) {
+  return m->hot[id].n_occ;
+}
+
+static inline bool can_start(const struct model *m, size_t id) {
+  return m->hot[id].flags & STATE_START;
+}
+
+// Byte length of any surface form of id; text is one of them.
+static inline size_t state_len(const struct model *m, size_t id, const char *text) {
+  return m->hot[id].len < UINT16_MAX ? m->hot[id].len : strlen(text);
+}
+
+static inline const char *surface(const struct model *m, size_t id) {
+  return m->display[id];
+}
+
+// Separator printed between tokens prev and id.
+static const char *separator_between(const struct model *m, size_t prev, size_t id) {
+  switch (m->tok->join) {
+  case JOIN_NONE: return "";
+  case JOIN_PUNCT:
+    return (m->hot[id].flags & STATE_CLOSES) || (m->hot[prev].flags & STATE_OPENS) ? "" : " ";
+  default: return " ";
+  }
+}
+
+#define RENDER_SLACK 16
+
+// Copies every display string into one pool, each preceded by a space, in
+// id order (so states that are close in the layout render from close bytes).
+static void build_render(struct model *m) {
+  size_t bytes = RENDER_SLACK;
+  for (size_t v = 0; v < m->n_states; ++v) bytes += state_len(m, v, m->display[v]) + 2;
+  char *p = m->render = (char *)xmalloc(bytes);
+  for (size_t v = 0; v < m->n_states; ++v) {
+    size_t len = state_len(m, v, m->display[v]);
+    *p++ = ' ';
+    memcpy(p, m->display[v], len + 1);
+    m->display[v] = p;
+    p += len + 1;
+  }
+  memset(p, 0, RENDER_SLACK);
+}
+
+// The walk is deterministic from v to the next token when v has a single
+// successor and does not end the sentence.
+static inline uint32_t chain_next(const struct model *m, size_t v) {
+  const struct state_hot *h = &m->hot[v];
+  return (h->flags & STATE_FIXED) && !h->end ? h->occ : UINT32_MAX;
+}
+
+// Collapses deterministic chains, as de Bruijn graph assemblers compact
+// unitigs. chain_next makes the states a functional graph; cutting it at
+// states with more than one (or no) deterministic predecessor leaves paths
+// (and pure cycles) on which each link belongs to exactly one path. Each
+// path is rendered once, separators included, and a state on it steps to
+// the path's end by emitting the suffix after its own position.
+static void build_macros(struct model *m) {
+  size_t n = m->n_states;
+  uint8_t *in = (uint8_t *)calloc(n ? n : 1, 1); // deterministic predecessors, saturating at 2
+  m->macro = (struct macro_step *)calloc(n ? n : 1, sizeof(struct macro_step));
+  if (!in || !m->macro) { fprintf(stderr, "OOM\n"); exit(1); }
+  size_t links = 0;
+  for (size_t v = 0; v < n; ++v) {
+    uint32_t w = chain_next(m, v);
+    if (w != UINT32_MAX) { ++links; if (in[w] < 2) in[w]++; }
+  }
+  size_t text_cap = 64, text_len = 0, n_ids = 0;
+  m->macro_text = (char *)xmalloc(text_cap);
+  m->macro_ids = (uint32_t *)xmalloc((links ? links : 1) * sizeof(uint32_t));
+  uint32_t *path = (uint32_t *)xmalloc((links + 1) * sizeof(uint32_t));
+  uint32_t *off = (uint32_t *)xmalloc((links + 1) * sizeof(uint32_t));
+  // Heads first, then whatever is left, which lies on pure cycles.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t head = 0; head < n; ++head) {
+      if (chain_next(m, head) == UINT32_MAX || m->macro[head].n || (pass == 0 && in[head] == 1)) continue;
+      size_t k = 0;
+      path[k++] = (uint32_t)head;
+      for (;;) {
+        uint32_t next = chain_next(m, path[k - 1]);
+        path[k++] = next;
+        if (next == head || in[next] != 1 || chain_next(m, next) == UINT32_MAX) break;
+      }
+      size_t ids0 = n_ids;
+      for (size_t i = 0; i + 1 < k; ++i) {
+        const char *sep = separator_between(m, path[i], path[i + 1]), *text = m->display[path[i + 1]];
+        size_t ns = strlen(sep), nt = strlen(text);
+        while (text_len + ns + nt + 1 > text_cap) text_cap *= 2;
+        m->macro_text = (char *)xrealloc(m->macro_text, text_cap);
+        off[i] = (uint32_t)text_len;
+        memcpy(m->macro_text + text_len, sep, ns);
+        memcpy(m->macro_text + text_len + ns, text, nt);
+        text_len += ns + nt;
+        m->macro_ids[n_ids++] = path[i + 1];
+      }
+      m->macro_text[text_len++] = '\0';
+      if (text_len > UINT32_MAX) { fprintf(stderr, "Chains too long for 32-bit offsets\n"); exit(1); }
+      size_t end = text_len - 1;
+      for (size_t i = 0; i + 1 < k; ++i) {
+        m->macro[path[i]] = (struct macro_step){ off[i], (uint32_t)(ids0 + i), (uint32_t)(k - 1 - i), (uint32_t)(end - off[i]) };
+      }
+    }
+  }
+  m->macro_text = (char *)xrealloc(m->macro_text, text_len + RENDER_SLACK);
+  memset(m->macro_text + text_len, 0, RENDER_SLACK);
+  free(path);
+  free(off);
+  free(in);
+}
+
+// Tokenizes text[0..len) (already sanitized) into a fresh model. The builder
+// state is reset by freeze_model, so this can run once per corpus.
+static void build_model_text(struct model *m, const struct tokenizer *t, bool fold, const char *text, size_t len) {
+  // freeze_model only sets what this model uses; the rest must read as absent.
+  memset(m, 0, sizeof *m);
+  hash_init();
+  ensure_tokens_capacity(); // allocate initial blocks
+  fold_keys = fold || t->fold;
+  tokenize_and_fill_succs(t, text, len);
+  freeze_model(m);
+  if (bfs_layout) layout_bfs(m);
+  m->tok = t;
+}
+
+// Builds the render pool and the chain macros once the model's token text is
+// final. Folded models pick surface forms per draw, and vocabulary-shared
+// models keep their text only in the shared dictionary: both render through
+// the plain copy path rather than hold a private copy of every token.
+static void prerender_model(struct model *m) {
+  if (m->fold || m->vocab) return;
+  build_render(m);
+  build_macros(m);
+}
+
+// Probes the frozen hash table from home slot h, which the caller has already
+// computed with key_hash.
+static int model_lookup_hashed(const struct model *m, const char *s, size_t len, size_t h) {
+  for (size_t probe = 0; probe < HASH_SIZE; ++probe) {
+    size_t i = (h + probe) % HASH_SIZE;
+    int id = m->hash_index[i];
+    if (id == -1) return -1;
+    if (key_equal(m->fold, m->tokens[id], s, len)) return id;
+  }
+  return -1;
+}
+
+// Read-only lookup of a token span as written (folded on the fly when the
+// model is case-folded); safe to call concurrently on a frozen model.
+static int model_lookup(const struct model *m, const char *s, size_t len) {
+  if (m->vocab) {
+    int64_t g = vocab_lookup(m->vocab, s, len);
+    if (g < 0) return -1;
+    size_t lo = 0, hi = m->n_states;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (m->global[m->by_global[mid]] < (uint64_t)g) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo < m->n_states && m->global[m->by_global[lo]] == (uint64_t)g ? (int)m->by_global[lo] : -1;
+  }
+  return model_lookup_hashed(m, s, len, key_hash(m->fold, s, len) % HASH_SIZE);
+}
+
+#define LOOKUP_BATCH 32
+
+// Resolves up to LOOKUP_BATCH spans at once. Hashing the whole batch first and
+// prefetching each home slot (then each token string) overlaps the cache misses
+// that a span-at-a-time loop would take one after another.
+static void model_lookup_batch(const struct model *m, const struct span *sp, size_t n, int *ids) {
+  if (m->vocab) {
+    for (size_t i = 0; i < n; ++i) ids[i] = model_lookup(m, sp[i].p, sp[i].len);
+    return;
+  }
+  size_t slot[LOOKUP_BATCH];
+  for (size_t i = 0; i < n; ++i) {
+    slot[i] = key_hash(m->fold, sp[i].p, sp[i].len) % HASH_SIZE;
+    __builtin_prefetch(&m->hash_index[slot[i]]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    int id = m->hash_index[slot[i]];
+    if (id >= 0) __builtin_prefetch(m->tokens[id]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    ids[i] = model_lookup_hashed(m, sp[i].p, sp[i].len, slot[i]);
+  }
+}
+
+// --------------------------- Scoring ---------------------------
+
+// Add-one unigram with one extra slot for unseen tokens (id < 0).
+static double unigram_prob(const struct model *m, int id) {
+  double c = id >= 0 ? (double)m->freq[id] : 0.0;
+  return (c + 1.0) / ((double)m->n_tokens + (double)m->n_states + 1.0);
+}
+
+static uint32_t successor_count(const struct model *m, size_t prev, uint32_t id) {
+  uint32_t lo = m->row_off[prev], hi = m->row_off[prev + 1];
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (m->succ_id[mid] < id) lo = mid + 1;
+    else hi = mid;
+  }
+  return (lo < m->row_off[prev + 1] && m->succ_id[lo] == id) ? m->succ_count[lo] : 0;
+}
+
+// Witten-Bell interpolated bigram, so unseen transitions and unknown tokens
+// keep a non-zero probability:
+//   P(w|v) = (c(v,w) + T(v) * Puni(w)) / (c(v) + T(v)),  T(v) = distinct successors.
+// prev < 0 (start of text or unknown context) falls back to the unigram.
+static double transition_logprob(const struct model *m, int prev, int id) {
+  double pu = unigram_prob(m, id);
+  if (prev < 0) return log(pu);
+  double total = row_total(m, (size_t)prev);
+  if (total == 0) return log(pu);
+  double types = m->row_off[prev + 1] - m->row_off[prev];
+  double c = id >= 0 ? successor_count(m, (size_t)prev, (uint32_t)id) : 0.0;
+  return log((c + types * pu) / (total + types));
+}
+
+struct score {
+  double logprob;  // natural log
+  uint64_t tokens;
+  uint64_t oov;
+};
+
+// Scores the tokens in [begin, end) given the id of the token before them.
+static void score_range(const struct model *m, const char *begin, const char *end, int prev, struct score *s) {
+  struct span sp[LOOKUP_BATCH];
+  int ids[LOOKUP_BATCH];
+  const char *cur = begin;
+  for (;;) {
+    size_t n = 0;
+    while (n < LOOKUP_BATCH && m->tok->next(&cur, end, &sp[n])) ++n;
+    if (n == 0) break;
+    model_lookup_batch(m, sp, n, ids);
+    for (size_t i = 0; i < n; ++i) {
+      s->logprob += transition_logprob(m, prev, ids[i]);
+      s->oov += ids[i] < 0;
+      prev = ids[i];
+    }
+    s->tokens += n;
+  }
+}
+
+static char *read_stream(FILE *f, size_t *len) {
+  size_t cap = 1 << 16, n = 0;
+  char *buf = (char *)xmalloc(cap);
+  size_t r;
+  while ((r = fread(buf + n, 1, cap - n, f)) > 0) {
+    n += r;
+    if (n == cap) buf = (char *)xrealloc(buf, cap *= 2);
+  }
+  *len = n;
+  return buf;
+}
+
+// Prints "logprob<TAB>tokens<TAB>sentence" for each argument, or for each
+// sentence of stdin when no arguments are given. Sentences are scored on
+// their own, so the first token uses the unigram distribution.
+static int cmd_score(const struct model *m, int argc, char **argv) {
+  if (argc > 0) {
+    for (int i = 0; i < argc; ++i) {
+      struct score s = {0};
+      score_range(m, argv[i], argv[i] + strlen(argv[i]), -1, &s);
+      printf("%.4f\t%llu\t%s\n", s.logprob, (unsigned long long)s.tokens, argv[i]);
+    }
+    return 0;
+  }
+
+  size_t len;
+  char *text = read_stream(stdin, &len);
+  const char *cur = text, *end = text + len;
+  const char *start = NULL;
+  struct span sp;
+  for (;;) {
+    bool more = m->tok->next(&cur, end, &sp);
+    if (more && !start) start = sp.p;
+    if (start && (!more || is_terminal_char(sp.p[sp.len - 1]))) {
+      struct score s = {0};
+      score_range(m, start, cur, -1, &s);
+      printf("%.4f\t%llu\t", s.logprob, (unsigned long long)s.tokens);
+      for (const char *p = start; p < cur; ++p) putchar(is_delim((unsigned char)*p) ? ' ' : *p);
+      putchar('\n');
+      start = NULL;
+    }
+    if (!more) break;
+  }
+  free(text);
+  return 0;
+}
+
+// --------------------------- Parallel perplexity ---------------------------
+
+// Evaluation files are memory-mapped and cut into chunks at token boundaries so
+// a single multi-gigabyte document still spreads over all workers. Each chunk
+// looks up the token just before it to keep the bigram context exact.
+#define EVAL_CHUNK ((size_t)64 << 20)
+
+struct eval_doc {
+  const char *path;
+  const char *data;
+  size_t size;
+};
+
+struct eval_item {
+  size_t doc;
+  size_t begin, end;
+  struct score s;
+};
+
+struct eval_job {
+  const struct model *m;
+  const struct eval_doc *docs;
+  struct eval_item *items;
+  size_t n_items;
+  atomic_size_t next;
+};
+
+static int default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+// Starts n threads on fn(arg) and waits for all of them. Workers pull their
+// own work from arg, typically through an atomic counter.
+static void run_threads(int n, void *(*fn)(void *), void *arg) {
+  pthread_t *th = (pthread_t *)xmalloc((size_t)n * sizeof(pthread_t));
+  for (int i = 0; i < n; ++i) {
+    if (pthread_create(&th[i], NULL, fn, arg) != 0) { fprintf(stderr, "pthread_create failed\n"); exit(1); }
+  }
+  for (int i = 0; i < n; ++i) pthread_join(th[i], NULL);
+  free(th);
+}
+
+static void *eval_worker(void *arg) {
+  struct eval_job *job = (struct eval_job *)arg;
+  for (;;) {
+    size_t k = atomic_fetch_add(&job->next, 1);
+    if (k >= job->n_items) break;
+    struct eval_item *it = &job->items[k];
+    const char *data = job->docs[it->doc].data;
+
+    // Context: the last token of the whitespace-delimited word (and the
+    // whitespace after it) just before the chunk.
+    int prev = -1;
+    if (it->begin > 0) {
+      size_t j = it->begin;
+      while (j > 0 && is_delim((unsigned char)data[j - 1])) --j;
+      while (j > 0 && !is_delim((unsigned char)data[j - 1])) --j;
+      const char *cur = data + j;
+      struct span sp;
+      while (job->m->tok->next(&cur, data + it->begin, &sp)) prev = model_lookup(job->m, sp.p, sp.len);
+    }
+    score_range(job->m, data + it->begin, data + it->end, prev, &it->s);
+  }
+  return NULL;
+}
+
+static int cmd_perplexity(const struct model *m, int argc, char **argv) {
+  int threads = default_threads();
+  int first = 0;
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+      threads = atoi(argv[first + 1]);
+      first += 2;
+    } else {
+      fprintf(stderr, "perplexity: unknown option %s\n", argv[first]);
+      return 2;
+    }
+  }
+  if (threads < 1) threads = 1;
+  size_t n_docs = (size_t)(argc - first);
+  if (n_docs == 0) { fprintf(stderr, "perplexity: no input files\n"); return 2; }
+
+  struct eval_doc *docs = (struct eval_doc *)xmalloc(n_docs * sizeof *docs);
+  size_t n_items = 0, cap_items = n_docs;
+  struct eval_item *items = (struct eval_item *)xmalloc(cap_items * sizeof *items);
+  for (size_t d = 0; d < n_docs; ++d) {
+    const char *path = argv[first + (int)d];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { perror(path); exit(1); }
+    docs[d].path = path;
+    docs[d].size = (size_t)st.st_size;
+    docs[d].data = "";
+    if (docs[d].size) {
+      void *p = mmap(NULL, docs[d].size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) { perror(path); exit(1); }
+      madvise(p, docs[d].size, MADV_SEQUENTIAL);
+      docs[d].data = (const char *)p;
+    }
+    close(fd);
+
+    // Chunk boundaries are moved forward past the next run of whitespace so
+    // neither a token nor a whitespace token is split.
+    size_t begin = 0;
+    do {
+      size_t end = docs[d].size - begin > EVAL_CHUNK ? begin + EVAL_CHUNK : docs[d].size;
+      while (end < docs[d].size && !is_delim((unsigned char)docs[d].data[end])) ++end;
+      while (end < docs[d].size && is_delim((unsigned char)docs[d].data[end])) ++end;
+      if (n_items == cap_items) items = (struct eval_item *)xrealloc(items, (cap_items *= 2) * sizeof *items);
+      items[n_items++] = (struct eval_item){ .doc = d, .begin = begin, .end = end };
+      begin = end;
+    } while (begin < docs[d].size);
+  }
+
+  struct eval_job job = { .m = m, .docs = docs, .items = items, .n_items = n_items };
+  atomic_init(&job.next, 0);
+  if ((size_t)threads > n_items) threads = (int)n_items;
+  run_threads(threads, eval_worker, &job);
+
+  struct score all = {0};
+  size_t k = 0;
+  for (size_t d = 0; d < n_docs; ++d) {
+    struct score s = {0};
+    for (; k < n_items && items[k].doc == d; ++k) {
+      s.logprob += items[k].s.logprob;
+      s.tokens += items[k].s.tokens;
+      s.oov += items[k].s.oov;
+    }
+    all.logprob += s.logprob;
+    all.tokens += s.tokens;
+    all.oov += s.oov;
+    printf("%s\t%llu tokens\t%llu oov\tlogprob %.4f\tppl %.4f\n", docs[d].path,
+           (unsigned long long)s.tokens, (unsigned long long)s.oov, s.logprob,
+           s.tokens ? exp(-s.logprob / (double)s.tokens) : 0.0);
+    if (docs[d].size) munmap((void *)docs[d].data, docs[d].size);
+  }
+  if (n_docs > 1) {
+    printf("total\t%llu tokens\t%llu oov\tlogprob %.4f\tppl %.4f\n",
+           (unsigned long long)all.tokens, (unsigned long long)all.oov, all.logprob,
+           all.tokens ? exp(-all.logprob / (double)all.tokens) : 0.0);
+  }
+  free(items);
+  free(docs);
+  return 0;
+}
+
+// --------------------------- Novelty index ---------------------------
+
+// Set of hashes of every corpus window of `span` consecutive token ids. A
+// sentence copies the corpus verbatim for more than span - 1 tokens exactly
+// when one of its own windows of `span` ids is in the set (up to 64-bit
+// hash collisions). Windows are hashed with a polynomial rolling hash so a
+// whole sentence is checked in O(length).
+#define NOVELTY_BASE 0x9E3779B97F4A7C15ULL
+
+struct novelty_index {
+  size_t span;       // window length in tokens (maximum allowed copy + 1)
+  uint64_t pow;      // NOVELTY_BASE^(span - 1), to drop the oldest id
+  uint64_t *slots;   // open addressing, 0 = empty
+  size_t mask;
+};
+
+// Rolling window hash: h = sum (id_i + 1) * BASE^(span - 1 - i), mod 2^64.
+static inline uint64_t roll_push(uint64_t h, uint32_t id) {
+  return h * NOVELTY_BASE + (uint64_t)id + 1;
+}
+
+static inline uint64_t roll_pop(const struct novelty_index *ix, uint64_t h, uint32_t oldest) {
+  return h - ((uint64_t)oldest + 1) * ix->pow;
+}
+
+static bool novelty_contains(const struct novelty_index *ix, uint64_t window) {
+  uint64_t key = mix64(window);
+  for (size_t i = key & ix->mask;; i = (i + 1) & ix->mask) {
+    if (ix->slots[i] == key) return true;
+    if (ix->slots[i] == 0) return false;
+  }
+}
+
+static void novelty_insert(struct novelty_index *ix, uint64_t window) {
+  uint64_t key = mix64(window);
+  for (size_t i = key & ix->mask;; i = (i + 1) & ix->mask) {
+    if (ix->slots[i] == key) return;
+    if (ix->slots[i] == 0) { ix->slots[i] = key; return; }
+  }
+}
+
+// Indexes every window of max_copy + 1 tokens of the frozen corpus.
+static void build_novelty_index(const struct model *m, size_t max_copy, struct novelty_index *ix) {
+  if (!m->corpus) { fprintf(stderr, "--novel needs the corpus, which a model snapshot does not keep\n"); exit(2); }
+  ix->span = max_copy + 1;
+  ix->pow = 1;
+  for (size_t i = 1; i < ix->span; ++i) ix->pow *= NOVELTY_BASE;
+
+  size_t windows = m->n_tokens >= ix->span ? (size_t)m->n_tokens - ix->span + 1 : 0;
+  size_t cap = 16;
+  while (cap < windows * 2) cap <<= 1;
+  ix->slots = (uint64_t *)calloc(cap, sizeof(uint64_t));
+  if (!ix->slots) { fprintf(stderr, "OOM\n"); exit(1); }
+  ix->mask = cap - 1;
+
+  uint64_t h = 0;
+  for (size_t i = 0; i < m->n_tokens; ++i) {
+    if (i >= ix->span) h = roll_pop(ix, h, m->corpus[i - ix->span]);
+    h = roll_push(h, m->corpus[i]);
+    if (i + 1 >= ix->span) novelty_insert(ix, h);
+  }
+}
+
+static void free_novelty_index(struct novelty_index *ix) {
+  free(ix->slots);
+  ix->slots = NULL;
+}
+
+// True if ids[0..n) contains a window of ix->span ids that occurs in the corpus.
+static bool copies_corpus(const struct novelty_index *ix, const uint32_t *ids, size_t n) {
+  uint64_t h = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (i >= ix->span) h = roll_pop(ix, h, ids[i - ix->span]);
+    h = roll_push(h, ids[i]);
+    if (i + 1 >= ix->span && novelty_contains(ix, h)) return true;
+  }
+  return false;
+}
+
+// --------------------------- Suffix array index ---------------------------
+
+#define MAX_QUERY_TOKENS 4096
+
+// Suffix array and LCP array over the corpus token id sequence, for longest
+// corpus match queries. `frankentext index FILE` writes them after the model
+// is frozen; `frankentext match FILE` maps the file read-only at query time.
+//
+// File layout: struct sa_header, then corpus ids, SA and LCP as n uint32 each.
+#define SA_MAGIC "FTSA0001"
+
+struct sa_header {
+  char magic[8];
+  uint64_t n;           // corpus length in tokens
+  uint64_t n_states;    // vocabulary size of the model the ids refer to
+  uint64_t fingerprint; // model_fingerprint() of that model
+};
+
+// Ids depend on the corpus and tokenizer, so an index is only valid for the
+// model it was built from.
+static uint64_t model_fingerprint(const struct model *m) {
+  uint64_t h = mix64(m->n_states);
+  for (size_t i = 0; i < m->n_tokens; ++i) h = mix64(h ^ m->corpus[i]);
+  return h;
+}
+
+// SA-IS induced sorting (Nong, Zhang & Chan), over symbols in [0, upper].
+// Recursion depth is logarithmic: each level at most halves the input.
+static void sa_is(const int32_t *s, int32_t n, int32_t upper, int32_t *sa) {
+  if (n == 0) return;
+  if (n == 1) { sa[0] = 0; return; }
+  if (n == 2) {
+    sa[0] = s[0] < s[1] ? 0 : 1;
+    sa[1] = 1 - sa[0];
+    return;
+  }
+
+  // ls[i]: suffix i is S-type (smaller than suffix i + 1).
+  bool *ls = (bool *)xmalloc((size_t)n * sizeof(bool));
+  ls[n - 1] = false;
+  for (int32_t i = n - 2; i >= 0; --i) {
+    ls[i] = s[i] == s[i + 1] ? ls[i + 1] : s[i] < s[i + 1];
+  }
+  int32_t *sum_l = (int32_t *)calloc((size_t)upper + 2, sizeof(int32_t));
+  int32_t *sum_s = (int32_t *)calloc((size_t)upper + 2, sizeof(int32_t));
+  int32_t *buf = (int32_t *)xmalloc(((size_t)upper + 2) * sizeof(int32_t));
+  if (!sum_l || !sum_s) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (int32_t i = 0; i < n; ++i) {
+    if (!ls[i]) sum_s[s[i]]++;
+    else sum_l[s[i] + 1]++;
+  }
+  for (int32_t i = 0; i <= upper; ++i) {
+    sum_s[i] += sum_l[i];
+    if (i < upper) sum_l[i + 1] += sum_s[i];
+  }
+
+  int32_t *lms_map = (int32_t *)xmalloc(((size_t)n + 1) * sizeof(int32_t));
+  int32_t m = 0;
+  for (int32_t i = 0; i <= n; ++i) lms_map[i] = -1;
+  for (int32_t i = 1; i < n; ++i) {
+    if (!ls[i - 1] && ls[i]) lms_map[i] = m++;
+  }
+  int32_t *lms = (int32_t *)xmalloc(((size_t)m + 1) * sizeof(int32_t));
+  for (int32_t i = 1, k = 0; i < n; ++i) {
+    if (!ls[i - 1] && ls[i]) lms[k++] = i;
+  }
+
+#define SA_INDUCE(order)                                                     \
+  do {                                                                       \
+    for (int32_t i = 0; i < n; ++i) sa[i] = -1;                              \
+    memcpy(buf, sum_s, ((size_t)upper + 1) * sizeof(int32_t));               \
+    for (int32_t i = 0; i < m; ++i) sa[buf[s[(order)[i]]]++] = (order)[i];   \
+    memcpy(buf, sum_l, ((size_t)upper + 1) * sizeof(int32_t));               \
+    sa[buf[s[n - 1]]++] = n - 1;                                             \
+    for (int32_t i = 0; i < n; ++i) {                                        \
+      int32_t v = sa[i];                                                     \
+      if (v >= 1 && !ls[v - 1]) sa[buf[s[v - 1]]++] = v - 1;                 \
+    }                                                                        \
+    memcpy(buf, sum_l, ((size_t)upper + 1) * sizeof(int32_t));               \
+    for (int32_t i = n - 1; i >= 0; --i) {                                   \
+      int32_t v = sa[i];                                                     \
+      if (v >= 1 && ls[v - 1]) sa[--buf[s[v - 1] + 1]] = v - 1;              \
+    }                                                                        \
+  } while (0)
+
+  SA_INDUCE(lms);
+
+  if (m) {
+    // Name the sorted LMS substrings and sort them recursively.
+    int32_t *sorted_lms = (int32_t *)xmalloc((size_t)m * sizeof(int32_t));
+    int32_t k = 0;
+    for (int32_t i = 0; i < n; ++i) {
+      if (lms_map[sa[i]] != -1) sorted_lms[k++] = sa[i];
+    }
+    int32_t *rec_s = (int32_t *)xmalloc((size_t)m * sizeof(int32_t));
+    int32_t rec_upper = 0;
+    rec_s[lms_map[sorted_lms[0]]] = 0;
+    for (int32_t i = 1; i < m; ++i) {
+      int32_t l = sorted_lms[i - 1], r = sorted_lms[i];
+      int32_t end_l = lms_map[l] + 1 < m ? lms[lms_map[l] + 1] : n;
+      int32_t end_r = lms_map[r] + 1 < m ? lms[lms_map[r] + 1] : n;
+      bool same = true;
+      if (end_l - l != end_r - r) {
+        same = false;
+      } else {
+        while (l < end_l && s[l] == s[r]) { ++l; ++r; }
+        if (l == n || s[l] != s[r]) same = false;
+      }
+      if (!same) ++rec_upper;
+      rec_s[lms_map[sorted_lms[i]]] = rec_upper;
+    }
+
+    int32_t *rec_sa = (int32_t *)xmalloc((size_t)m * sizeof(int32_t));
+    sa_is(rec_s, m, rec_upper, rec_sa);
+    for (int32_t i = 0; i < m; ++i) sorted_lms[i] = lms[rec_sa[i]];
+    SA_INDUCE(sorted_lms);
+    free(rec_sa);
+    free(rec_s);
+    free(sorted_lms);
+  }
+#undef SA_INDUCE
+
+  free(lms);
+  free(lms_map);
+  free(buf);
+  free(sum_s);
+  free(sum_l);
+  free(ls);
+}
+
+// Kasai et al.: lcp[i] = common prefix of suffixes sa[i - 1] and sa[i]; lcp[0] = 0.
+static void build_lcp(const int32_t *s, int32_t n, const int32_t *sa, int32_t *lcp) {
+  int32_t *rank = (int32_t *)xmalloc((size_t)n * sizeof(int32_t));
+  for (int32_t i = 0; i < n; ++i) rank[sa[i]] = i;
+  int32_t h = 0;
+  for (int32_t i = 0; i < n; ++i) {
+    if (h > 0) --h;
+    if (rank[i] == 0) { h = 0; continue; }
+    int32_t j = sa[rank[i] - 1];
+    while (i + h < n && j + h < n && s[i + h] == s[j + h]) ++h;
+    lcp[rank[i]] = h;
+  }
+  if (n) lcp[0] = 0;
+  free(rank);
+}
+
+static int cmd_index(const struct model *m, int argc, char **argv) {
+  if (argc != 1) { fprintf(stderr, "index: expected an output file\n"); return 2; }
+  if (m->n_tokens >= INT32_MAX) { fprintf(stderr, "index: corpus too large\n"); return 1; }
+  int32_t n = (int32_t)m->n_tokens;
+  const int32_t *s = (const int32_t *)m->corpus; // ids < INT32_MAX
+  int32_t *sa = (int32_t *)xmalloc((size_t)n * sizeof(int32_t));
+  int32_t *lcp = (int32_t *)xmalloc((size_t)n * sizeof(int32_t));
+  sa_is(s, n, m->n_states ? (int32_t)m->n_states - 1 : 0, sa);
+  build_lcp(s, n, sa, lcp);
+
+  struct sa_header hdr = { .n = (uint64_t)n, .n_states = m->n_states, .fingerprint = model_fingerprint(m) };
+  memcpy(hdr.magic, SA_MAGIC, sizeof hdr.magic);
+  FILE *f = fopen(argv[0], "wb");
+  if (!f) { perror(argv[0]); return 1; }
+  if (fwrite(&hdr, sizeof hdr, 1, f) != 1 ||
+      fwrite(m->corpus, sizeof(uint32_t), (size_t)n, f) != (size_t)n ||
+      fwrite(sa, sizeof(int32_t), (size_t)n, f) != (size_t)n ||
+      fwrite(lcp, sizeof(int32_t), (size_t)n, f) != (size_t)n ||
+      fclose(f) != 0) {
+    perror(argv[0]);
+    return 1;
+  }
+  free(sa);
+  free(lcp);
+  return 0;
+}
+
+struct sa_index {
+  void *map;
+  size_t map_size;
+  uint32_t n;
+  const uint32_t *text;
+  const uint32_t *sa;
+  const uint32_t *lcp;
+};
+
+static bool open_sa_index(const struct model *m, const char *path, struct sa_index *ix) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); return false; }
+  ix->map_size = (size_t)st.st_size;
+  ix->map = ix->map_size >= sizeof(struct sa_header)
+              ? mmap(NULL, ix->map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (ix->map == MAP_FAILED) { fprintf(stderr, "%s: not a suffix array index\n", path); return false; }
+
+  const struct sa_header *hdr = (const struct sa_header *)ix->map;
+  if (memcmp(hdr->magic, SA_MAGIC, sizeof hdr->magic) != 0 ||
+      ix->map_size != sizeof *hdr + 3 * hdr->n * sizeof(uint32_t)) {
+    fprintf(stderr, "%s: not a suffix array index\n", path);
+    munmap(ix->map, ix->map_size);
+    return false;
+  }
+  if (hdr->n_states != m->n_states || hdr->fingerprint != model_fingerprint(m)) {
+    fprintf(stderr, "%s: index was built from a different corpus\n", path);
+    munmap(ix->map, ix->map_size);
+    return false;
+  }
+  ix->n = (uint32_t)hdr->n;
+  ix->text = (const uint32_t *)(hdr + 1);
+  ix->sa = ix->text + ix->n;
+  ix->lcp = ix->sa + ix->n;
+  return true;
+}
+
+// Length of the common prefix of q[0..k) and the corpus suffix at pos.
+static uint32_t sa_common(const struct sa_index *ix, uint32_t pos, const uint32_t *q, uint32_t k) {
+  uint32_t l = 0;
+  while (l < k && pos + l < ix->n && ix->text[pos + l] == q[l]) ++l;
+  return l;
+}
+
+struct sa_match {
+  uint32_t len;   // longest run of query tokens found verbatim in the corpus
+  uint32_t start; // where that run starts in the query
+  uint32_t pos;   // one corpus position of the run
+  uint32_t count; // corpus occurrences of the run
+};
+
+// For each query start, a binary search finds where the query suffix would
+// sit in the SA; its longest corpus match is with one of the two neighbours.
+// The occurrence count is the width of the LCP interval around that rank.
+static struct sa_match sa_longest_match(const struct sa_index *ix, const uint32_t *q, uint32_t k) {
+  struct sa_match best = {0};
+  for (uint32_t i = 0; i < k; ++i) {
+    uint32_t lo = 0, hi = ix->n;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      uint32_t pos = ix->sa[mid];
+      uint32_t l = sa_common(ix, pos, q + i, k - i);
+      bool suffix_less = l < k - i && (pos + l == ix->n || ix->text[pos + l] < q[i + l]);
+      if (suffix_less) lo = mid + 1;
+      else hi = mid;
+    }
+    uint32_t rank = lo, len = 0;
+    if (lo < ix->n) len = sa_common(ix, ix->sa[lo], q + i, k - i);
+    if (lo > 0) {
+      uint32_t l = sa_common(ix, ix->sa[lo - 1], q + i, k - i);
+      if (l > len) { len = l; rank = lo - 1; }
+    }
+    if (len > best.len) {
+      uint32_t a = rank, b = rank;
+      while (a > 0 && ix->lcp[a] >= len) --a;
+      while (b + 1 < ix->n && ix->lcp[b + 1] >= len) ++b;
+      best = (struct sa_match){ .len = len, .start = i, .pos = ix->sa[rank], .count = b - a + 1 };
+    }
+  }
+  return best;
+}
+
+static void print_match(const struct model *m, const struct sa_index *ix, const char *sentence) {
+  uint32_t q[MAX_QUERY_TOKENS];
+  uint32_t k = 0;
+  const char *cur = sentence, *end = sentence + strlen(sentence);
+  struct span sp;
+  while (k < MAX_QUERY_TOKENS && m->tok->next(&cur, end, &sp)) {
+    int id = model_lookup(m, sp.p, sp.len);
+    q[k++] = id < 0 ? UINT32_MAX : (uint32_t)id; // unknown tokens never match
+  }
+  struct sa_match best = sa_longest_match(ix, q, k);
+  printf("%u\t%u\t", best.len, best.count);
+  for (uint32_t i = 0; i < best.len; ++i) {
+    uint32_t id = ix->text[best.pos + i];
+    printf("%s%s", i ? separator_between(m, ix->text[best.pos + i - 1], id) : "", surface(m, id));
+  }
+  putchar('\n');
+}
+
+// Prints "length<TAB>occurrences<TAB>matched tokens" for each sentence given
+// as an argument, or for each line of stdin.
+static int cmd_match(const struct model *m, int argc, char **argv) {
+  if (argc < 1) { fprintf(stderr, "match: expected an index file\n"); return 2; }
+  struct sa_index ix;
+  if (!open_sa_index(m, argv[0], &ix)) return 1;
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) print_match(m, &ix, argv[i]);
+  } else {
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, stdin) > 0) print_match(m, &ix, line);
+    free(line);
+  }
+  munmap(ix.map, ix.map_size);
+  return 0;
+}
+
+// --------------------------- Random numbers ---------------------------
+
+// splitmix64: one add and a few multiplies per draw, and a plain struct so
+// every generator (or thread) can own its stream.
+struct rng {
+  uint64_t s;
+};
+
+static inline uint64_t rng_next(struct rng *r) {
+  uint64_t z = (r->s += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Uniform in [0, n) by multiply-shift (Lemire); n < 2^32.
+static inline uint32_t rng_below(struct rng *r, uint32_t n) {
+  return (uint32_t)(((rng_next(r) & 0xFFFFFFFFULL) * n) >> 32);
+}
+
+// Uniform in [0, 1) with 53 random bits.
+static inline double rng_unit(struct rng *r) {
+  return (double)(rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+// Seed from the clock and pid, for runs without an explicit --seed.
+static uint64_t fresh_seed(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return mix64((uint64_t)ts.tv_sec * 1000000007ULL ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32));
+}
+
+// --------------------------- Tempered sampling ---------------------------
+
+// Temperature T reshapes a row to P(w | v) ∝ count(v, w)^(1/T); top-p then
+// keeps the smallest set of most likely successors whose mass reaches p.
+// Each row becomes an alias table over the kept successors, so a draw is one
+// rng_below, one 32-bit compare and one load, as cheap as the plain walk.
+// Rows are built on first visit and published with a compare-and-swap, so a
+// temper can be shared by generator threads; temper_fill builds every row up
+// front in parallel for bulk runs that will touch most of them anyway.
+#define TEMPER_MIN 0.01
+
+struct alias_slot {
+  uint32_t id;        // successor kept when the 32-bit draw is below threshold
+  uint32_t alias;     // successor taken otherwise
+  uint32_t threshold;
+};
+
+struct temper_row {
+  uint32_t n;
+  struct alias_slot slot[];
+};
+
+struct temper {
+  const struct model *m;
+  double inv_t;
+  double top_p;
+  _Atomic(struct temper_row *) *rows;
+};
+
+static void temper_init(struct temper *t, const struct model *m, double temperature, double top_p) {
+  t->m = m;
+  t->inv_t = 1.0 / temperature;
+  t->top_p = top_p;
+  t->rows = (_Atomic(struct temper_row *) *)calloc(m->n_states ? m->n_states : 1, sizeof *t->rows);
+  if (!t->rows) { fprintf(stderr, "OOM\n"); exit(1); }
+}
+
+static void temper_free(struct temper *t) {
+  if (!t->rows) return;
+  for (size_t v = 0; v < t->m->n_states; ++v) free(atomic_load_explicit(&t->rows[v], memory_order_relaxed));
+  free(t->rows);
+  t->rows = NULL;
+}
+
+struct weighted_succ {
+  uint32_t id;
+  uint32_t count;
+  double w;
+};
+
+static int cmp_weighted_desc(const void *a, const void *b) {
+  const struct weighted_succ *x = (const struct weighted_succ *)a, *y = (const struct weighted_succ *)b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Vose's alias method over the kept prefix of row v.
+static struct temper_row *temper_build_row(const struct temper *t, size_t v) {
+  const struct model *m = t->m;
+  uint32_t lo = m->row_off[v], k = m->row_off[v + 1] - lo;
+  struct weighted_succ *s = (struct weighted_succ *)xmalloc((k ? k : 1) * sizeof *s);
+  uint32_t top = 0;
+  for (uint32_t j = 0; j < k; ++j) {
+    s[j] = (struct weighted_succ){ m->succ_id[lo + j], m->succ_count[lo + j], 0.0 };
+    if (s[j].count > top) top = s[j].count;
+  }
+  qsort(s, k, sizeof *s, cmp_weighted_desc);
+  double total = 0.0;
+  for (uint32_t j = 0; j < k; ++j) total += s[j].w = exp((log((double)s[j].count) - log((double)top)) * t->inv_t);
+  uint32_t n = 0;
+  double kept = 0.0;
+  while (n < k && (n == 0 || kept < t->top_p * total)) kept += s[n++].w;
+
+  struct temper_row *row = (struct temper_row *)xmalloc(sizeof *row + n * sizeof(struct alias_slot));
+  row->n = n;
+  uint32_t *small = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *large = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t ns = 0, nl = 0;
+  for (uint32_t j = 0; j < n; ++j) {
+    s[j].w = s[j].w * n / kept;
+    if (s[j].w < 1.0) small[ns++] = j;
+    else large[nl++] = j;
+  }
+  while (ns && nl) {
+    uint32_t a = small[--ns], g = large[nl - 1];
+    row->slot[a] = (struct alias_slot){ s[a].id, s[g].id, (uint32_t)(s[a].w * 4294967296.0) };
+    s[g].w -= 1.0 - s[a].w;
+    if (s[g].w < 1.0) { --nl; small[ns++] = g; }
+  }
+  // Leftovers are 1 up to rounding: always keep them.
+  while (nl) { uint32_t g = large[--nl]; row->slot[g] = (struct alias_slot){ s[g].id, s[g].id, UINT32_MAX }; }
+  while (ns) { uint32_t a = small[--ns]; row->slot[a] = (struct alias_slot){ s[a].id, s[a].id, UINT32_MAX }; }
+  free(small);
+  free(large);
+  free(s);
+  return row;
+}
+
+static const struct temper_row *temper_row(const struct temper *t, size_t v) {
+  struct temper_row *row = atomic_load_explicit(&t->rows[v], memory_order_acquire);
+  if (row) return row;
+  struct temper_row *fresh = temper_build_row(t, v);
+  if (atomic_compare_exchange_strong_explicit(&t->rows[v], &row, fresh, memory_order_acq_rel, memory_order_acquire)) {
+    return fresh;
+  }
+  free(fresh); // another thread published the same row first
+  return row;
+}
+
+// Draws a successor of v, which must have a non-empty row.
+static inline size_t temper_sample(const struct temper *t, size_t v, struct rng *rng) {
+  const struct temper_row *row = temper_row(t, v);
+  const struct alias_slot *s = &row->slot[rng_below(rng, row->n)];
+  return (uint32_t)rng_next(rng) < s->threshold ? s->id : s->alias;
+}
+
+struct temper_fill_job {
+  struct temper *t;
+  atomic_size_t next;
+};
+
+static void *temper_fill_worker(void *arg) {
+  struct temper_fill_job *job = (struct temper_fill_job *)arg;
+  const struct model *m = job->t->m;
+  for (;;) {
+    size_t first = atomic_fetch_add(&job->next, 4096);
+    if (first >= m->n_states) break;
+    size_t end = first + 4096 < m->n_states ? first + 4096 : m->n_states;
+    for (size_t v = first; v < end; ++v) {
+      if (m->row_off[v + 1] > m->row_off[v]) temper_row(job->t, v);
+    }
+  }
+  return NULL;
+}
+
+static void temper_fill(struct temper *t, int threads) {
+  struct temper_fill_job job = { .t = t };
+  atomic_init(&job.next, 0);
+  run_threads(threads, temper_fill_worker, &job);
+}
+
+// Parses --temperature / --top-p at argv[*i]. Returns false if argv[*i] is
+// neither; exits on a bad value.
+static bool parse_temper_option(int argc, char **argv, int *i, double *temperature, double *top_p) {
+  if (*i + 1 >= argc) return false;
+  if (strcmp(argv[*i], "--temperature") == 0) {
+    *temperature = atof(argv[++*i]);
+    if (!(*temperature >= TEMPER_MIN)) { fprintf(stderr, "--temperature must be at least %g\n", TEMPER_MIN); exit(2); }
+    return true;
+  }
+  if (strcmp(argv[*i], "--top-p") == 0) {
+    *top_p = atof(argv[++*i]);
+    if (!(*top_p > 0.0 && *top_p <= 1.0)) { fprintf(stderr, "--top-p must be in (0, 1]\n"); exit(2); }
+    return true;
+  }
+  return false;
+}
+
+// --------------------------- Sentence generation ---------------------------
+
+#define MAX_SENTENCE_TOKENS 2048
+#define MAX_LENGTH_CONDITION 256 // longest --max-words; keeps sentences well inside buf
+#define NOVELTY_RETRIES 16
+
+// Knobs for generate_sentence; a zeroed struct reproduces the plain random walk.
+struct gen_params {
+  // When set, the walk resamples successors that would complete a copied
+  // corpus window, and sentences that cannot avoid one are rejected.
+  const struct novelty_index *novel;
+  // When set, every sentence is drawn from the walk conditioned on its
+  // length and terminal character (see struct length_dp).
+  struct length_dp *length;
+  // When set, successors are drawn from the tempered / top-p rows instead of
+  // the raw counts. Not combined with length.
+  const struct temper *temper;
+  // When set, every step is taken by one model of the mixture, picked by
+  // blend weight (see struct blend). Not combined with the others.
+  const struct blend *blend;
+};
+
+static size_t random_token_id_that_starts_a_sentence(const struct model *m, struct rng *rng) {
+  // Try random picks first
+  for (int attempts = 0; attempts < 10000; ++attempts) {
+    if (m->n_states == 0) break;
+    size_t i = rng_below(rng, (uint32_t)m->n_states);
+    if (can_start(m, i)) return i;
+  }
+  // Fallback: first capitalized token
+  for (size_t i = 0; i < m->n_states; ++i) {
+    if (can_start(m, i)) return i;
+  }
+  return 0;
+}
+
+// --------------------------- Length-conditioned sampling ---------------------------
+
+// h(v, k) is the probability that a walk standing on token v emits exactly k
+// more tokens and stops on a token whose last character is in `ends`:
+//   h(v, 0) = [v ends in one of `ends`]
+//   h(v, k) = 0 for k > 0 if v ends any sentence, else sum_w P(w|v) h(w, k - 1)
+// Sampling each successor w with weight P(w|v) * sum over allowed k of
+// h(w, k) draws exactly from the walk conditioned on the sentence length
+// landing in [min_len, max_len], so every sample meets the bounds.
+// Rows of h are allocated and filled on first use and kept for later
+// sentences, so frequently visited tokens are only ever computed once.
+// Not thread-safe: the cache is filled while sampling.
+struct length_dp {
+  size_t min_len, max_len; // sentence length in tokens, inclusive
+  const char *ends;        // allowed terminal characters
+  double **h;              // h[v] -> max_len entries, NAN = not computed yet
+  double *start_cum;       // running start mass through each token, computed on first sentence
+  double start_total;
+  size_t start_last;       // last token with positive start mass
+  double *scratch;         // successor weights in length_dp_next, sized to the widest row
+  size_t n_states;
+};
+
+static void length_dp_init(struct length_dp *dp, const struct model *m, size_t min_len, size_t max_len, const char *ends) {
+  dp->min_len = min_len;
+  dp->max_len = max_len;
+  dp->ends = ends;
+  dp->n_states = m->n_states;
+  dp->h = (double **)calloc(m->n_states ? m->n_states : 1, sizeof(double *));
+  if (!dp->h) { fprintf(stderr, "OOM\n"); exit(1); }
+  dp->start_cum = NULL;
+  dp->start_total = 0.0;
+  dp->start_last = SIZE_MAX;
+  uint32_t widest = 1;
+  for (size_t v = 0; v < m->n_states; ++v) {
+    if (m->row_off[v + 1] - m->row_off[v] > widest) widest = m->row_off[v + 1] - m->row_off[v];
+  }
+  dp->scratch = (double *)xmalloc(widest * sizeof(double));
+}
+
+static void length_dp_free(struct length_dp *dp) {
+  for (size_t i = 0; i < dp->n_states; ++i) free(dp->h[i]);
+  free(dp->h);
+  free(dp->start_cum);
+  free(dp->scratch);
+  dp->h = NULL;
+  dp->start_cum = NULL;
+  dp->scratch = NULL;
+}
+
+static double length_dp_h(const struct model *m, struct length_dp *dp, size_t v, size_t k) {
+  double *row = dp->h[v];
+  if (!row) {
+    row = dp->h[v] = (double *)xmalloc(dp->max_len * sizeof(double));
+    for (size_t i = 0; i < dp->max_len; ++i) row[i] = NAN;
+  }
+  if (!isnan(row[k])) return row[k];
+
+  double p = 0.0;
+  const char *tok = m->tokens[v];
+  if (token_ends_a_sentence(tok)) {
+    p = (k == 0 && strchr(dp->ends, last_char(tok))) ? 1.0 : 0.0;
+  } else if (k > 0 && row_total(m, v) > 0) {
+    for (uint32_t j = m->row_off[v]; j < m->row_off[v + 1]; ++j) {
+      p += (double)m->succ_count[j] * length_dp_h(m, dp, m->succ_id[j], k - 1);
+    }
+    p /= (double)row_total(m, v);
+  }
+  return dp->h[v][k] = p;
+}
+
+// Probability that a sentence whose len-th token is v ends within the bounds.
+static double length_dp_mass(const struct model *m, struct length_dp *dp, size_t v, size_t len) {
+  if (len > dp->max_len) return 0.0;
+  size_t lo = dp->min_len > len ? dp->min_len - len : 0;
+  double z = 0.0;
+  for (size_t k = lo; len + k <= dp->max_len; ++k) z += length_dp_h(m, dp, v, k);
+  return z;
+}
+
+// Start tokens are capitalized tokens, uniformly, as in the plain walk;
+// conditioning reweights each by its mass. SIZE_MAX if none can satisfy it.
+// The running sums are built once, so each draw is a binary search.
+static size_t length_dp_start(const struct model *m, struct length_dp *dp, struct rng *rng) {
+  if (!dp->start_cum) {
+    dp->start_cum = (double *)xmalloc((m->n_states ? m->n_states : 1) * sizeof(double));
+    for (size_t i = 0; i < m->n_states; ++i) {
+      double w = can_start(m, i) ? length_dp_mass(m, dp, i, 1) : 0.0;
+      if (w > 0.0) {
+        dp->start_total += w;
+        dp->start_last = i;
+      }
+      dp->start_cum[i] = dp->start_total;
+    }
+  }
+  if (dp->start_total <= 0.0) return SIZE_MAX;
+  double r = rng_unit(rng) * dp->start_total;
+  // First token whose running sum passes r; tokens without mass repeat the
+  // previous sum, so they are never chosen.
+  size_t lo = 0, hi = dp->start_last;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (dp->start_cum[mid] > r) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+// Draws the (len + 1)-th token after v. Successors that would complete a
+// copied corpus window (when novel is set) get zero weight. SIZE_MAX when no
+// successor can finish the sentence within the bounds.
+static size_t length_dp_next(const struct model *m, struct length_dp *dp, size_t v, size_t len,
+                             const struct novelty_index *novel, uint64_t window, struct rng *rng) {
+  double total = 0.0;
+  uint32_t lo = m->row_off[v], hi = m->row_off[v + 1];
+  double *w = dp->scratch;
+  for (uint32_t j = lo; j < hi; ++j) {
+    uint32_t id = m->succ_id[j];
+    bool copied = novel && len + 1 >= novel->span && novelty_contains(novel, roll_push(window, id));
+    w[j - lo] = copied ? 0.0 : (double)m->succ_count[j] * length_dp_mass(m, dp, id, len + 1);
+    total += w[j - lo];
+  }
+  size_t next = SIZE_MAX;
+  if (total > 0.0) {
+    double r = rng_unit(rng) * total;
+    for (uint32_t j = lo; j < hi; ++j) {
+      if (w[j - lo] <= 0.0) continue;
+      next = m->succ_id[j];
+      if ((r -= w[j - lo]) < 0.0) break;
+    }
+  }
+  return next;
+}
+
+// Most frequent surface form of id at the given sentence position.
+static const char *surface_at(const struct model *m, size_t id, bool initial) {
+  if (!m->fold) return surface(m, id);
+  const uint32_t *w = initial ? m->form_initial : m->form_other;
+  const char *best = NULL;
+  uint32_t best_count = 0;
+  for (uint32_t j = m->form_off[id]; j < m->form_off[id + 1]; ++j) {
+    if (w[j] > best_count) { best = m->form_text[j]; best_count = w[j]; }
+  }
+  if (best) return best;
+  for (uint32_t j = m->form_off[id]; j < m->form_off[id + 1]; ++j) {
+    if (capitalized(m->form_text[j]) == initial) return m->form_text[j];
+  }
+  return surface(m, id);
+}
+
+// Surface form of id for output. Folded models draw it from the forms seen at
+// the same sentence position; other models have exactly one form.
+static const char *sample_surface(const struct model *m, size_t id, bool initial, struct rng *rng) {
+  if (!m->fold) return surface(m, id);
+  uint32_t lo = m->form_off[id], hi = m->form_off[id + 1];
+  const uint32_t *w = initial ? m->form_initial : m->form_other;
+  double total = 0.0;
+  for (uint32_t j = lo; j < hi; ++j) total += w[j];
+  if (total == 0.0) return surface_at(m, id, initial);
+  double r = rng_unit(rng) * total;
+  for (uint32_t j = lo; j < hi; ++j) {
+    if ((r -= w[j]) < 0.0) return m->form_text[j];
+  }
+  return m->form_text[hi - 1];
+}
+
+// Picks a sentence start that followed the terminal token `after` in the
+// corpus, so consecutive sentences chain the way the book does. Falls back
+// to a random start when `after` is SIZE_MAX or has no capitalized successor.
+static size_t start_after(const struct model *m, size_t after, struct rng *rng) {
+  if (after != SIZE_MAX) {
+    uint32_t nsucc = row_total(m, after);
+    for (int tries = 0; nsucc && tries < 8; ++tries) {
+      uint32_t id = m->hot[after].flags & STATE_FIXED ? m->hot[after].occ
+                    : m->occ_id ? m->occ_id[m->hot[after].occ + rng_below(rng, nsucc)]
+                                : (uint32_t)temper_sample(m->sampler, after, rng);
+      if (can_start(m, id)) return id;
+    }
+  }
+  return random_token_id_that_starts_a_sentence(m, rng);
+}
+
+// Resumable state of one sentence walk. walker_next yields a token (or a
+// whole deterministic chain) at a time, so callers can interleave many walks
+// (e.g. one per client connection) on one thread; generate_sentence runs a
+// walker to completion.
+struct walker {
+  const struct model *m;  // for a blend, the model that yielded the last token
+  const struct gen_params *gp;
+  struct rng rng;
+  size_t after;     // terminal token of the previous sentence, or SIZE_MAX
+  size_t curr;      // last yielded token id, SIZE_MAX before the first
+  size_t n;         // tokens yielded
+  size_t chars;     // bytes yielded, separators included
+  size_t max_chars; // the walk ends before a token would reach this many bytes
+  uint64_t window;  // rolling hash of the last span - 1 ids (novelty only)
+  uint32_t *ids;    // MAX_SENTENCE_TOKENS slots; only needed with a novelty index
+  bool done;        // the last yielded token ends the sentence
+  uint64_t sig[2];  // two polynomial hashes of the yielded ids (see walker_signature)
+};
+
+struct walk_token {
+  const char *sep;  // separator to print before text ("" for the first token)
+  const char *text; // one token, or a pre-rendered chain with its separators
+  size_t len;       // strlen(text)
+  bool slack;       // RENDER_SLACK bytes after text may be read (pre-rendered pools)
+};
+
+enum walk_status {
+  WALK_TOKEN,  // *tok holds the next token
+  WALK_END,    // the sentence is complete
+  WALK_REJECT, // the walk failed a novelty or length constraint
+};
+
+static void walker_start(struct walker *w, const struct model *m, const struct gen_params *gp,
+                         struct rng rng, size_t after, uint32_t *ids, size_t max_chars) {
+  memset(w, 0, sizeof *w);
+  w->m = m;
+  w->gp = gp;
+  w->rng = rng;
+  w->after = after;
+  w->curr = SIZE_MAX;
+  w->ids = ids;
+  w->max_chars = max_chars;
+}
+
+static inline void walker_absorb(struct walker *w, size_t id) {
+  w->sig[0] = w->sig[0] * 0x9E3779B97F4A7C15ULL + id + 1;
+  w->sig[1] = w->sig[1] * 0xD6E8FEB86659FD93ULL + id + 1;
+}
+
+// 128-bit hash of the token id sequence walked so far. Two independent 64-bit
+// polynomial hashes, each finished with the length, so distinct sentences
+// collide with probability about 2^-128 per pair.
+static inline void walker_signature(const struct walker *w, uint64_t sig[2]) {
+  sig[0] = mix64(w->sig[0] ^ w->n);
+  sig[1] = mix64(w->sig[1] + w->n * 0x94D049BB133111EBULL);
+}
+
+static bool blend_enter(const struct blend *b, struct walker *w);
+
+static inline size_t walk_draw(struct walker *w, size_t v, uint32_t nsucc) {
+  if (w->m->hot[v].flags & STATE_FIXED) return w->m->hot[v].occ;
+  if (w->gp && w->gp->temper) return temper_sample(w->gp->temper, v, &w->rng);
+  if (!w->m->occ_id) return temper_sample(w->m->sampler, v, &w->rng);
+  return w->m->occ_id[w->m->hot[v].occ + rng_below(&w->rng, nsucc)];
+}
+
+static enum walk_status walker_next(struct walker *w, struct walk_token *tok) {
+  const struct blend *blend = w->gp ? w->gp->blend : NULL;
+  // A blend first moves the walk onto the model that takes this step. When
+  // no model has a row for the current state, the row check below ends it.
+  if (blend && !w->done && !blend_enter(blend, w) && w->curr == SIZE_MAX) return WALK_REJECT;
+  const struct model *m = w->m;
+  const struct novelty_index *novel = w->gp ? w->gp->novel : NULL;
+  struct length_dp *dp = w->gp ? w->gp->length : NULL;
+
+  if (w->curr == SIZE_MAX) {
+    if (m->n_states == 0) return WALK_REJECT;
+    size_t id = dp ? length_dp_start(m, dp, &w->rng) : start_after(m, w->after, &w->rng);
+    if (id == SIZE_MAX) return WALK_REJECT;
+    tok->sep = "";
+    tok->text = sample_surface(m, id, true, &w->rng);
+    tok->len = state_len(m, id, tok->text);
+    tok->slack = m->render != NULL;
+    w->curr = id;
+    walker_absorb(w, id);
+    w->chars = tok->len;
+    w->done = m->hot[id].end != 0;
+    if (w->ids) w->ids[w->n] = (uint32_t)id;
+    w->n++;
+    if (novel) w->window = roll_push(0, (uint32_t)id);
+    return WALK_TOKEN;
+  }
+
+  size_t nsucc = row_total(m, w->curr);
+  if (w->done || w->chars + 2 >= w->max_chars || w->n >= MAX_SENTENCE_TOKENS || nsucc == 0) {
+    w->done = true;
+    if (novel && copies_corpus(novel, w->ids, w->n)) return WALK_REJECT;
+    return WALK_END;
+  }
+
+  // A whole deterministic chain in one step, when it fits: the per-token
+  // checks below could not end the walk inside it. Novelty and length
+  // conditioning look at every id, and a blend may switch models at every
+  // state, so they step token by token.
+  const struct macro_step *ms = m->macro && !novel && !dp && !blend ? &m->macro[w->curr] : NULL;
+  if (ms && ms->n && w->chars + ms->bytes + 1 < w->max_chars && w->n + ms->n <= MAX_SENTENCE_TOKENS) {
+    const uint32_t *ids = m->macro_ids + ms->ids;
+    for (uint32_t j = 0; j < ms->n; ++j) walker_absorb(w, ids[j]);
+    tok->sep = "";
+    tok->text = m->macro_text + ms->text;
+    tok->len = ms->bytes;
+    tok->slack = true;
+    w->chars += ms->bytes;
+    w->n += ms->n;
+    w->curr = ids[ms->n - 1];
+    w->done = m->hot[w->curr].end != 0;
+    return WALK_TOKEN;
+  }
+
+  size_t next_id;
+  if (dp) {
+    next_id = length_dp_next(m, dp, w->curr, w->n, novel, w->window, &w->rng);
+    if (next_id == SIZE_MAX) return WALK_REJECT;
+  } else {
+    next_id = walk_draw(w, w->curr, (uint32_t)nsucc);
+  }
+  if (!dp && novel && w->n + 1 >= novel->span) {
+    // Steer away from successors that would complete a copied window.
+    int tries = 0;
+    while (novelty_contains(novel, roll_push(w->window, (uint32_t)next_id))) {
+      if (++tries == NOVELTY_RETRIES) return WALK_REJECT;
+      next_id = walk_draw(w, w->curr, (uint32_t)nsucc);
+    }
+  }
+  tok->text = sample_surface(m, next_id, false, &w->rng);
+  tok->len = state_len(m, next_id, tok->text);
+  tok->sep = separator_between(m, w->curr, next_id);
+  tok->slack = m->render != NULL;
+  if (m->render && tok->sep[0]) {
+    // Separators are "" or " ", and the pool has the space already.
+    tok->text--;
+    tok->len++;
+    tok->sep = "";
+  }
+
+  size_t add = (tok->sep[0] != '\0') + tok->len;
+  if (w->chars + add + 1 >= w->max_chars) {
+    w->done = true;
+    if (novel && copies_corpus(novel, w->ids, w->n)) return WALK_REJECT;
+    return WALK_END;
+  }
+  w->chars += add;
+  if (novel) {
+    w->window = roll_push(w->window, (uint32_t)next_id);
+    if (w->n + 1 >= novel->span) w->window = roll_pop(novel, w->window, w->ids[w->n + 1 - novel->span]);
+    w->ids[w->n] = (uint32_t)next_id;
+  }
+  w->n++;
+  w->curr = next_id;
+  walker_absorb(w, next_id);
+  w->done = m->hot[next_id].end != 0;
+  return WALK_TOKEN;
+}
+
+// Runs w to completion, rendering into out (max_chars of w must be out_size).
+// Returns WALK_END, or WALK_REJECT with out set to the empty string.
+static enum walk_status walk_render(struct walker *w, char *out, size_t out_size) {
+  struct walk_token tok;
+  enum walk_status st;
+  size_t len = 0;
+  while ((st = walker_next(w, &tok)) == WALK_TOKEN) {
+    size_t ns = tok.sep[0] != '\0', nt = tok.len;
+#ifdef __SSE2__
+    // Most tokens fit one 16-byte copy; the bytes past them are overwritten
+    // by the next token or ignored after the terminator.
+    if (tok.slack && ns == 0 && nt <= 16 && len + 16 < out_size) {
+      _mm_storeu_si128((__m128i *)(out + len), _mm_loadu_si128((const __m128i *)tok.text));
+      len += nt;
+      continue;
+    }
+#endif
+    if (len + ns + nt >= out_size) nt = out_size - 1 - len - ns; // only an oversized first token
+    memcpy(out + len, tok.sep, ns);
+    memcpy(out + len + ns, tok.text, nt);
+    len += ns + nt;
+  }
+  out[st == WALK_END ? len : 0] = '\0';
+  return st;
+}
+
+// Writes a sentence into out. Returns out, or an empty string when the walk was
+// rejected (only possible with a novelty index or a length constraint).
+// `after` is the terminal token of the previous sentence, or SIZE_MAX; the id
+// of the sentence's last token is stored in *last when last is not NULL.
+static char *generate_sentence(const struct model *m, const struct gen_params *gp, struct rng *rng,
+                               size_t after, char *out, size_t out_size, size_t *last) {
+  if (out_size == 0) return out;
+  if (last) *last = SIZE_MAX;
+
+  uint32_t ids[MAX_SENTENCE_TOKENS];
+  struct walker w;
+  walker_start(&w, m, gp, *rng, after, gp && gp->novel ? ids : NULL, out_size);
+  enum walk_status st = walk_render(&w, out, out_size);
+  *rng = w.rng;
+  if (last && st == WALK_END) *last = w.curr;
+  return out;
+}
+
+static bool ends_with_char(const char *s, char c) {
+  return last_char(s) == c;
+}
+
+// --------------------------- Beam search ---------------------------
+
+// Deterministic counterpart of generate_sentence: the B most probable
+// sentences under the maximum-likelihood bigram model that end in one of the
+// requested terminal characters within a length bound.
+struct beam_cand {
+  double score;    // log-probability of the sentence so far
+  uint32_t id;     // last token
+  int32_t node;    // history node of the last token (see beam_node)
+};
+
+struct beam_node {
+  uint32_t id;
+  int32_t parent;  // -1 for the first token
+};
+
+static int cmp_cand_desc(const void *a, const void *b) {
+  double x = ((const struct beam_cand *)a)->score, y = ((const struct beam_cand *)b)->score;
+  return (x < y) - (x > y);
+}
+
+static int cmp_cand_asc(const void *a, const void *b) {
+  return cmp_cand_desc(b, a);
+}
+
+// Keeps the cap highest-scoring candidates, worst at [0].
+static inline void beam_heap_push(struct beam_cand *h, size_t *n, size_t cap, struct beam_cand c) {
+  heap_offer(h, n, cap, sizeof c, &c, cmp_cand_asc);
+}
+
+// frankentext beam [-b B] [-n MAX_TOKENS] [--end CHARS] [--start WORD]
+static int cmd_beam(const struct model *m, int argc, char **argv) {
+  size_t width = 10, max_len = 40;
+  const char *ends = ".?!";
+  const char *start = NULL;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) width = (size_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) max_len = (size_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--end") == 0 && i + 1 < argc) ends = argv[++i];
+    else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) start = argv[++i];
+    else { fprintf(stderr, "beam: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (width == 0 || max_len == 0) return 0;
+
+  // log(count) for every successor entry, so a row expands with one add each.
+  size_t n_succ = m->row_off[m->n_states];
+  float *log_count = (float *)xmalloc(n_succ * sizeof(float));
+  for (size_t j = 0; j < n_succ; ++j) log_count[j] = logf((float)m->succ_count[j]);
+
+  size_t nodes_cap = 1024, n_nodes = 0;
+  struct beam_node *nodes = (struct beam_node *)xmalloc(nodes_cap * sizeof *nodes);
+  struct beam_cand *beam = (struct beam_cand *)xmalloc(width * sizeof *beam);
+  struct beam_cand *next = (struct beam_cand *)xmalloc(width * sizeof *next);
+  struct beam_cand *done = (struct beam_cand *)xmalloc(width * sizeof *done);
+  size_t n_beam = 0, n_next = 0, n_done = 0;
+  float *row_score = NULL;
+  size_t row_cap = 0;
+
+  // Initial beam: the given start token, or the most frequent capitalized tokens.
+  if (start) {
+    int id = model_lookup(m, start, strlen(start));
+    if (id < 0) { fprintf(stderr, "beam: unknown start token %s\n", start); return 1; }
+    beam_heap_push(beam, &n_beam, width, (struct beam_cand){ 0.0, (uint32_t)id, -1 });
+  } else {
+    double log_n = log((double)m->n_tokens);
+    for (size_t i = 0; i < m->n_states; ++i) {
+      if (!can_start(m, i)) continue;
+      beam_heap_push(beam, &n_beam, width, (struct beam_cand){ log((double)m->freq[i]) - log_n, (uint32_t)i, -1 });
+    }
+  }
+  for (size_t i = 0; i < n_beam; ++i) {
+    nodes[n_nodes] = (struct beam_node){ beam[i].id, -1 };
+    beam[i].node = (int32_t)n_nodes++;
+    if (m->hot[beam[i].id].end) {
+      if (strchr(ends, m->hot[beam[i].id].end)) beam_heap_push(done, &n_done, width, beam[i]);
+      beam[i].score = -INFINITY; // finished, do not expand
+    }
+  }
+
+  for (size_t len = 1; len < max_len && n_beam; ++len) {
+    n_next = 0;
+    for (size_t b = 0; b < n_beam; ++b) {
+      const struct beam_cand *c = &beam[b];
+      // Scores only decrease, so nothing below the worst finished sentence can win.
+      if (c->score == -INFINITY || (n_done == width && c->score <= done[0].score)) continue;
+      uint32_t lo = m->row_off[c->id], hi = m->row_off[c->id + 1];
+      if (lo == hi) continue; // dead end
+      if (hi - lo > row_cap) row_score = (float *)xrealloc(row_score, (row_cap = hi - lo) * sizeof(float));
+      float base = (float)(c->score - log((double)row_total(m, c->id)));
+      for (uint32_t j = lo; j < hi; ++j) row_score[j - lo] = base + log_count[j];
+
+      float floor = n_next == width ? (float)next[0].score : -INFINITY;
+      for (uint32_t j = lo; j < hi; ++j) {
+        float s = row_score[j - lo];
+        if (s <= floor) continue;
+        uint32_t id = m->succ_id[j];
+        struct beam_cand cand = { s, id, c->node };
+        if (m->hot[id].end) {
+          if (!strchr(ends, m->hot[id].end)) continue;
+          if (n_done == width && s <= done[0].score) continue;
+          if (n_nodes == nodes_cap) nodes = (struct beam_node *)xrealloc(nodes, (nodes_cap *= 2) * sizeof *nodes);
+          nodes[n_nodes] = (struct beam_node){ id, c->node };
+          cand.node = (int32_t)n_nodes++;
+          beam_heap_push(done, &n_done, width, cand);
+        } else {
+          beam_heap_push(next, &n_next, width, cand);
+          if (n_next == width) floor = (float)next[0].score;
+        }
+      }
+    }
+    // Only the survivors get history nodes.
+    for (size_t i = 0; i < n_next; ++i) {
+      if (n_nodes == nodes_cap) nodes = (struct beam_node *)xrealloc(nodes, (nodes_cap *= 2) * sizeof *nodes);
+      nodes[n_nodes] = (struct beam_node){ next[i].id, next[i].node };
+      next[i].node = (int32_t)n_nodes++;
+    }
+    struct beam_cand *t = beam; beam = next; next = t;
+    n_beam = n_next;
+  }
+
+  qsort(done, n_done, sizeof *done, cmp_cand_desc);
+  uint32_t path[MAX_SENTENCE_TOKENS];
+  for (size_t i = 0; i < n_done; ++i) {
+    size_t k = 0;
+    for (int32_t v = done[i].node; v >= 0 && k < MAX_SENTENCE_TOKENS; v = nodes[v].parent) path[k++] = nodes[v].id;
+    printf("%.4f\t%s", done[i].score, surface_at(m, path[--k], true));
+    while (k--) printf("%s%s", separator_between(m, path[k + 1], path[k]), surface_at(m, path[k], false));
+    putchar('\n');
+  }
+
+  free(row_score);
+  free(done);
+  free(next);
+  free(beam);
+  free(nodes);
+  free(log_count);
+  return 0;
+}
+
+// --------------------------- Document generation ---------------------------
+
+// Growable output buffer; documents are rendered into one and handed to
+// the writer whole.
+struct outbuf {
+  char *data;
+  size_t len, cap;
+};
+
+static void outbuf_append(struct outbuf *b, const char *s, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) cap *= 2;
+    b->data = (char *)xrealloc(b->data, cap);
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+// writev(2) until every iovec is out, advancing past partial writes.
+static void writev_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n > IOV_MAX ? IOV_MAX : n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("writev");
+      exit(1);
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= (ssize_t)iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= (size_t)w;
+    }
+  }
+}
+
+// write(2) until everything is out; exits on errors (EPIPE included).
+static void write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      exit(1);
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+}
+
+// Paragraphs of k sentences. Each sentence starts with a token that followed
+// the previous sentence's terminal in the corpus; a sentence that does not
+// end on a terminal (dead end) makes the next one start fresh.
+static void render_document(const struct model *m, const struct gen_params *gp, struct rng *rng,
+                            long paragraphs, long sentences, struct outbuf *out) {
+  char buf[4096];
+  size_t after = SIZE_MAX;
+  for (long p = 0; p < paragraphs; ++p) {
+    if (p) outbuf_append(out, "\n\n", 2);
+    for (long s = 0; s < sentences; ++s) {
+      size_t last = SIZE_MAX;
+      for (int tries = 0; tries < 1000; ++tries) {
+        generate_sentence(m, gp, rng, after, buf, sizeof buf, &last);
+        if (buf[0]) break;
+      }
+      if (!buf[0]) continue;
+      if (s) outbuf_append(out, " ", 1);
+      outbuf_append(out, buf, strlen(buf));
+      after = last != SIZE_MAX && m->hot[last].end ? last : SIZE_MAX;
+    }
+  }
+  outbuf_append(out, "\n\n\n", 3); // a blank line between paragraphs, two between documents
+}
+
+// Producer threads render whole documents into a ring of DOC_SLOTS buffers
+// while the main thread writes finished ones in order. Document i is seeded
+// from (seed, i), so the output does not depend on the thread count.
+#define DOC_SLOTS 64
+#define DOC_WRITE_BATCH 16 // documents per writev
+
+struct doc_job {
+  const struct model *m;
+  const struct gen_params *gp;
+  uint64_t seed;
+  long docs, paragraphs, sentences;
+  atomic_long next;
+  pthread_mutex_t lock;
+  pthread_cond_t filled, drained;
+  long written;                  // documents before this one are on the fd
+  struct outbuf slot[DOC_SLOTS];
+  bool ready[DOC_SLOTS];
+};
+
+static void *doc_worker(void *arg) {
+  struct doc_job *job = (struct doc_job *)arg;
+  struct outbuf local = {0};
+  for (;;) {
+    long i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->docs) break;
+    struct rng rng = { mix64(job->seed + (uint64_t)i) };
+    local.len = 0;
+    render_document(job->m, job->gp, &rng, job->paragraphs, job->sentences, &local);
+
+    // Wait for the slot to be drained, then swap buffers with it.
+    pthread_mutex_lock(&job->lock);
+    while (i - job->written >= DOC_SLOTS) pthread_cond_wait(&job->drained, &job->lock);
+    struct outbuf *s = &job->slot[i % DOC_SLOTS];
+    struct outbuf t = *s;
+    *s = local;
+    local = t;
+    job->ready[i % DOC_SLOTS] = true;
+    pthread_cond_signal(&job->filled);
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(local.data);
+  return NULL;
+}
+
+// frankentext doc [-d DOCS] [-p PARAGRAPHS] [-k SENTENCES] [-j THREADS] [--seed S] [--novel L]
+static int cmd_doc(const struct model *m, int argc, char **argv) {
+  long docs = 1, paragraphs = 3, sentences = 5;
+  int threads = default_threads();
+  uint64_t seed = fresh_seed();
+  double temperature = 1.0, top_p = 1.0;
+  struct gen_params gp = {0};
+  struct novelty_index novel = {0};
+  for (int i = 0; i < argc; ++i) {
+    if (parse_temper_option(argc, argv, &i, &temperature, &top_p)) continue;
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) docs = atol(argv[++i]);
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) paragraphs = atol(argv[++i]);
+    else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) sentences = atol(argv[++i]);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--novel") == 0 && i + 1 < argc) {
+      int max_copy = atoi(argv[++i]);
+      if (max_copy < 1) { fprintf(stderr, "--novel needs a span of at least 1 token\n"); return 2; }
+      build_novelty_index(m, (size_t)max_copy, &novel);
+      gp.novel = &novel;
+    } else { fprintf(stderr, "doc: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (threads < 1) threads = 1;
+  if (docs <= 0 || paragraphs <= 0 || sentences <= 0) return 0;
+  struct temper temper = {0};
+  if (temperature != 1.0 || top_p < 1.0) {
+    temper_init(&temper, m, temperature, top_p);
+    temper_fill(&temper, threads);
+    gp.temper = &temper;
+  }
+
+  struct doc_job *job = (struct doc_job *)calloc(1, sizeof *job);
+  if (!job) { fprintf(stderr, "OOM\n"); exit(1); }
+  *job = (struct doc_job){ .m = m, .gp = &gp, .seed = seed, .docs = docs, .paragraphs = paragraphs, .sentences = sentences };
+  atomic_init(&job->next, 0);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->filled, NULL);
+  pthread_cond_init(&job->drained, NULL);
+
+  pthread_t *th = (pthread_t *)xmalloc((size_t)threads * sizeof(pthread_t));
+  for (int i = 0; i < threads; ++i) {
+    if (pthread_create(&th[i], NULL, doc_worker, job) != 0) { fprintf(stderr, "pthread_create failed\n"); exit(1); }
+  }
+
+  // Writer: gather the run of consecutive finished documents and writev them.
+  struct iovec iov[DOC_WRITE_BATCH];
+  pthread_mutex_lock(&job->lock);
+  while (job->written < docs) {
+    while (!job->ready[job->written % DOC_SLOTS]) pthread_cond_wait(&job->filled, &job->lock);
+    int n = 0;
+    while (n < DOC_WRITE_BATCH && job->written + n < docs && job->ready[(job->written + n) % DOC_SLOTS]) {
+      struct outbuf *s = &job->slot[(job->written + n) % DOC_SLOTS];
+      iov[n].iov_base = s->data;
+      iov[n].iov_len = s->len;
+      ++n;
+    }
+    pthread_mutex_unlock(&job->lock);
+    writev_all(STDOUT_FILENO, iov, n);
+    pthread_mutex_lock(&job->lock);
+    for (int k = 0; k < n; ++k) job->ready[(job->written + k) % DOC_SLOTS] = false;
+    job->written += n;
+    pthread_cond_broadcast(&job->drained);
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  for (int i = 0; i < threads; ++i) pthread_join(th[i], NULL);
+  free(th);
+  for (int i = 0; i < DOC_SLOTS; ++i) free(job->slot[i].data);
+  pthread_cond_destroy(&job->drained);
+  pthread_cond_destroy(&job->filled);
+  pthread_mutex_destroy(&job->lock);
+  free(job);
+  temper_free(&temper);
+  free_novelty_index(&novel);
+  return 0;
+}
+
+// --------------------------- Output writer ---------------------------
+
+// Bulk output sink shared by generator threads. Each thread appends records
+// to its own wbuf and only takes the writer lock to flush WRITER_FLUSH bytes
+// at a time, so records are never interleaved and the lock is rare.
+//   WRITE_FD:     plain write(2) to the fd (stdout or a file)
+//   WRITE_DIRECT: file opened with O_DIRECT; flushes are copied into one shared
+//                 aligned stage so whole blocks go out and the partial block
+//                 stays in front of the next flush; the last one on close
+//   WRITE_MMAP:   file grown with ftruncate and filled through a shared mapping
+#define WRITER_FLUSH ((size_t)1 << 20)
+#define WRITER_ALIGN 4096
+#define WRITER_MAP_GROW ((size_t)64 << 20)
+
+enum write_kind { WRITE_FD, WRITE_DIRECT, WRITE_MMAP };
+
+struct writer {
+  int fd;
+  enum write_kind kind;
+  pthread_mutex_t lock;
+  pthread_rwlock_t map_lock;  // WRITE_MMAP: copies hold it shared, growth exclusive
+  off_t offset;               // WRITE_DIRECT / WRITE_MMAP: bytes written so far
+  char *map;
+  size_t map_size;
+  char *stage;                // WRITE_DIRECT: aligned staging buffer
+  size_t stage_len;
+};
+
+struct wbuf {
+  struct writer *w;
+  char *data;
+  size_t len, cap;
+};
+
+// Opens path (NULL = stdout) for the given kind; false with a message on error.
+static bool writer_open(struct writer *w, const char *path, enum write_kind kind) {
+  memset(w, 0, sizeof *w);
+  w->kind = kind;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_rwlock_init(&w->map_lock, NULL);
+  if (!path) {
+    if (kind != WRITE_FD) { fprintf(stderr, "--direct and --mmap need an output file (-o)\n"); return false; }
+    w->fd = STDOUT_FILENO;
+    return true;
+  }
+  int flags = O_CREAT | O_TRUNC | (kind == WRITE_MMAP ? O_RDWR : O_WRONLY);
+  if (kind == WRITE_DIRECT) flags |= O_DIRECT;
+  w->fd = open(path, flags, 0644);
+  if (w->fd < 0) { perror(path); return false; }
+  if (kind == WRITE_DIRECT) {
+    void *p = NULL;
+    if (posix_memalign(&p, WRITER_ALIGN, 2 * WRITER_FLUSH + WRITER_ALIGN) != 0) { fprintf(stderr, "OOM\n"); exit(1); }
+    w->stage = (char *)p;
+  }
+  return true;
+}
+
+static void writer_map_grow(struct writer *w, size_t need) {
+  size_t size = w->map_size ? w->map_size : WRITER_MAP_GROW;
+  while (size < need) size *= 2;
+  if (ftruncate(w->fd, (off_t)size) != 0) { perror("ftruncate"); exit(1); }
+  void *p = w->map ? mremap(w->map, w->map_size, size, MREMAP_MAYMOVE)
+                   : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if (p == MAP_FAILED) { perror("mmap"); exit(1); }
+  w->map = (char *)p;
+  w->map_size = size;
+}
+
+static void pwrite_all(int fd, const char *p, size_t n, off_t *offset) {
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, *offset);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("pwrite");
+      exit(1);
+    }
+    p += w;
+    n -= (size_t)w;
+    *offset += w;
+  }
+}
+
+// Moves the buffered bytes of b to the sink.
+static void wbuf_flush(struct wbuf *b) {
+  struct writer *w = b->w;
+  switch (w->kind) {
+  case WRITE_FD:
+    pthread_mutex_lock(&w->lock);
+    write_all(w->fd, b->data, b->len);
+    pthread_mutex_unlock(&w->lock);
+    b->len = 0;
+    break;
+  case WRITE_DIRECT:
+    pthread_mutex_lock(&w->lock);
+    for (size_t done = 0; done < b->len;) {
+      size_t n = b->len - done;
+      if (n > 2 * WRITER_FLUSH - w->stage_len) n = 2 * WRITER_FLUSH - w->stage_len;
+      memcpy(w->stage + w->stage_len, b->data + done, n);
+      w->stage_len += n;
+      done += n;
+      size_t whole = w->stage_len & ~(size_t)(WRITER_ALIGN - 1);
+      pwrite_all(w->fd, w->stage, whole, &w->offset);
+      memmove(w->stage, w->stage + whole, w->stage_len - whole);
+      w->stage_len -= whole;
+    }
+    pthread_mutex_unlock(&w->lock);
+    b->len = 0;
+    break;
+  case WRITE_MMAP: {
+    pthread_mutex_lock(&w->lock);
+    size_t at = (size_t)w->offset;
+    w->offset += (off_t)b->len;
+    if ((size_t)w->offset > w->map_size) {
+      pthread_rwlock_wrlock(&w->map_lock);
+      writer_map_grow(w, (size_t)w->offset);
+      pthread_rwlock_unlock(&w->map_lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    pthread_rwlock_rdlock(&w->map_lock);
+    memcpy(w->map + at, b->data, b->len);
+    pthread_rwlock_unlock(&w->map_lock);
+    b->len = 0;
+    break;
+  }
+  }
+}
+
+static void wbuf_init(struct wbuf *b, struct writer *w) {
+  b->w = w;
+  b->len = 0;
+  b->cap = 2 * WRITER_FLUSH;
+  b->data = (char *)malloc(b->cap);
+  if (!b->data) { fprintf(stderr, "OOM\n"); exit(1); }
+}
+
+// Makes room for n more bytes. Never flushes, so a record is always written
+// in one piece; callers end each record with wbuf_end_record.
+static char *wbuf_reserve(struct wbuf *b, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap * 2;
+    while (cap < b->len + n) cap *= 2;
+    b->data = (char *)realloc(b->data, cap);
+    if (!b->data) { fprintf(stderr, "OOM\n"); exit(1); }
+    b->cap = cap;
+  }
+  return b->data + b->len;
+}
+
+static void wbuf_end_record(struct wbuf *b) {
+  if (b->len >= WRITER_FLUSH) wbuf_flush(b);
+}
+
+static void wbuf_close(struct wbuf *b) {
+  wbuf_flush(b);
+  free(b->data);
+  b->data = NULL;
+}
+
+static void writer_close(struct writer *w) {
+  if (w->kind == WRITE_DIRECT && w->stage_len) {
+    // The last partial block cannot go out with O_DIRECT: clear it first.
+    int fl = fcntl(w->fd, F_GETFL);
+    if (fl < 0 || fcntl(w->fd, F_SETFL, fl & ~O_DIRECT) != 0) { perror("fcntl"); exit(1); }
+    pwrite_all(w->fd, w->stage, w->stage_len, &w->offset);
+  }
+  if (w->kind == WRITE_MMAP) {
+    if (w->map) munmap(w->map, w->map_size);
+    if (ftruncate(w->fd, w->offset) != 0) { perror("ftruncate"); exit(1); }
+  }
+  if (w->fd != STDOUT_FILENO) close(w->fd);
+  free(w->stage);
+  pthread_rwlock_destroy(&w->map_lock);
+  pthread_mutex_destroy(&w->lock);
+}
+
+// Appends s[0..n) as the body of a JSON string. The common case, a 16-byte
+// block with no quote, backslash or control byte, is one compare-and-store.
+static void wbuf_json_escaped(struct wbuf *b, const char *s, size_t n) {
+  char *out = wbuf_reserve(b, 6 * n); // worst case: every byte as \u00XX
+  char *o = out;
+  size_t i = 0;
+  for (;;) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), space = _mm_set1_epi8(' ');
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      // Bytes >= 0x80 are negative as signed chars, so mask them out of "< ' '".
+      __m128i ctrl = _mm_andnot_si128(_mm_cmplt_epi8(v, _mm_setzero_si128()), _mm_cmplt_epi8(v, space));
+      __m128i bad = _mm_or_si128(ctrl, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+      int mask = _mm_movemask_epi8(bad);
+      _mm_storeu_si128((__m128i *)o, v);
+      if (mask) {
+        int k = __builtin_ctz((unsigned)mask);
+        o += k;
+        i += (size_t)k;
+        break;
+      }
+      o += 16;
+    }
+#endif
+    if (i >= n) break;
+    unsigned char c = (unsigned char)s[i++];
+    if (c == '"' || c == '\\') { *o++ = '\\'; *o++ = (char)c; }
+    else if (c == '\n') { *o++ = '\\'; *o++ = 'n'; }
+    else if (c == '\t') { *o++ = '\\'; *o++ = 't'; }
+    else if (c < 0x20) { o += sprintf(o, "\\u%04x", c); }
+    else *o++ = (char)c;
+  }
+  b->len += (size_t)(o - out);
+}
+
+static void wbuf_append(struct wbuf *b, const char *s, size_t n) {
+  memcpy(wbuf_reserve(b, n), s, n);
+  b->len += n;
+}
+
+// --------------------------- Bulk generation ---------------------------
+
+enum out_format { FORMAT_TEXT, FORMAT_JSONL };
+
+// Set of 128-bit sentence signatures for --unique, split into independently
+// locked shards picked by the top bits, so threads rarely wait on each other
+// and no sentence text is ever compared.
+#define UNIQUE_SHARDS 64
+
+struct unique_shard {
+  pthread_mutex_t lock;
+  uint64_t (*keys)[2]; // open addressing, {0, 0} = empty
+  size_t mask, n;
+  char pad[64];        // keep neighbouring locks off one cache line
+};
+
+struct unique_set {
+  struct unique_shard shard[UNIQUE_SHARDS];
+};
+
+static void unique_init(struct unique_set *s) {
+  for (size_t i = 0; i < UNIQUE_SHARDS; ++i) {
+    struct unique_shard *sh = &s->shard[i];
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->mask = 1023;
+    sh->n = 0;
+    sh->keys = calloc(sh->mask + 1, sizeof *sh->keys);
+    if (!sh->keys) { fprintf(stderr, "OOM\n"); exit(1); }
+  }
+}
+
+static void unique_free(struct unique_set *s) {
+  for (size_t i = 0; i < UNIQUE_SHARDS; ++i) {
+    free(s->shard[i].keys);
+    pthread_mutex_destroy(&s->shard[i].lock);
+  }
+}
+
+static void unique_put(uint64_t (*keys)[2], size_t mask, const uint64_t k[2]) {
+  size_t i = k[0] & mask;
+  while (keys[i][0] | keys[i][1]) i = (i + 1) & mask;
+  keys[i][0] = k[0];
+  keys[i][1] = k[1];
+}
+
+// Adds sig; true if it was not in the set yet.
+static bool unique_insert(struct unique_set *s, const uint64_t sig[2]) {
+  struct unique_shard *sh = &s->shard[sig[1] >> 58]; // UNIQUE_SHARDS == 64
+  pthread_mutex_lock(&sh->lock);
+  for (size_t i = sig[0] & sh->mask; sh->keys[i][0] | sh->keys[i][1]; i = (i + 1) & sh->mask) {
+    if (sh->keys[i][0] == sig[0] && sh->keys[i][1] == sig[1]) {
+      pthread_mutex_unlock(&sh->lock);
+      return false;
+    }
+  }
+  if (2 * (sh->n + 1) > sh->mask + 1) {
+    size_t mask = 2 * sh->mask + 1;
+    uint64_t (*keys)[2] = calloc(mask + 1, sizeof *keys);
+    if (!keys) { fprintf(stderr, "OOM\n"); exit(1); }
+    for (size_t i = 0; i <= sh->mask; ++i) {
+      if (sh->keys[i][0] | sh->keys[i][1]) unique_put(keys, mask, sh->keys[i]);
+    }
+    free(sh->keys);
+    sh->keys = keys;
+    sh->mask = mask;
+  }
+  unique_put(sh->keys, sh->mask, sig);
+  sh->n++;
+  pthread_mutex_unlock(&sh->lock);
+  return true;
+}
+
+struct gen_job {
+  const struct model *m;
+  const struct gen_params *gp;
+  struct writer *w;
+  enum out_format format;
+  uint64_t seed;
+  long count;
+  atomic_long next;          // next attempt index
+  // --unique: sentences are numbered in acceptance order instead.
+  struct unique_set *unique;
+  atomic_long accepted;
+  atomic_long misses;        // duplicates since the last accepted sentence
+  atomic_long dropped;       // without --unique: records whose every walk failed
+};
+
+// Walks tried for one record before it is dropped (rejected by --novel, or
+// never reaching a sentence end).
+#define GEN_TRIES 1000
+
+// --unique gives up after this many duplicates in a row: the model is then
+// (nearly) out of distinct sentences.
+#define UNIQUE_GIVE_UP (1L << 18)
+
+#define GEN_BLOCK 4096 // sentences claimed per atomic increment
+
+static void *gen_worker(void *arg) {
+  struct gen_job *job = (struct gen_job *)arg;
+  struct wbuf b;
+  wbuf_init(&b, job->w);
+  char buf[4096];
+  uint32_t ids[MAX_SENTENCE_TOKENS];
+  long limit = job->unique ? LONG_MAX - GEN_BLOCK : job->count;
+  for (;;) {
+    long first = atomic_fetch_add(&job->next, GEN_BLOCK);
+    if (first >= limit) break;
+    if (job->unique && (atomic_load(&job->accepted) >= job->count || atomic_load(&job->misses) >= UNIQUE_GIVE_UP)) break;
+    long end = first + GEN_BLOCK < limit ? first + GEN_BLOCK : limit;
+    struct rng rng = { mix64(job->seed + (uint64_t)first) };
+    for (long i = first; i < end; ++i) {
+      struct walker walk;
+      enum walk_status st = WALK_END;
+      for (int tries = 0; tries < GEN_TRIES; ++tries) {
+        walker_start(&walk, job->m, job->gp, rng, SIZE_MAX, job->gp->novel ? ids : NULL, sizeof buf);
+        st = walk_render(&walk, buf, sizeof buf);
+        rng = walk.rng;
+        if (st == WALK_END) break;
+      }
+      // Never emit (or sign) a sentence the walk did not finish; under
+      // --unique it counts against the give-up budget like a duplicate.
+      if (st != WALK_END) {
+        if (!job->unique) atomic_fetch_add(&job->dropped, 1);
+        else if (atomic_fetch_add(&job->misses, 1) >= UNIQUE_GIVE_UP) break;
+        continue;
+      }
+      long id = i;
+      if (job->unique) {
+        uint64_t sig[2];
+        walker_signature(&walk, sig);
+        if (!unique_insert(job->unique, sig)) {
+          if (atomic_fetch_add(&job->misses, 1) >= UNIQUE_GIVE_UP) break;
+          continue;
+        }
+        atomic_store(&job->misses, 0);
+        id = atomic_fetch_add(&job->accepted, 1);
+        if (id >= job->count) break;
+      }
+      size_t n = strlen(buf);
+      if (job->format == FORMAT_JSONL) {
+        char head[48];
+        wbuf_append(&b, head, (size_t)snprintf(head, sizeof head, "{\"id\":%ld,\"text\":\"", id));
+        wbuf_json_escaped(&b, buf, n);
+        wbuf_append(&b, "\"}\n", 3);
+      } else {
+        wbuf_append(&b, buf, n);
+        wbuf_append(&b, "\n", 1);
+      }
+      wbuf_end_record(&b);
+    }
+  }
+  wbuf_close(&b);
+  return NULL;
+}
+
+// frankentext gen -n COUNT [-j N] [--format text|jsonl] [-o FILE [--direct|--mmap]] [--seed S] [--novel L]
+static int cmd_gen(const struct model *m, int argc, char **argv) {
+  long count = 10;
+  int threads = default_threads();
+  uint64_t seed = fresh_seed();
+  enum out_format format = FORMAT_TEXT;
+  enum write_kind kind = WRITE_FD;
+  bool unique = false;
+  const char *path = NULL;
+  double temperature = 1.0, top_p = 1.0;
+  struct gen_params gp = {0};
+  struct novelty_index novel = {0};
+  for (int i = 0; i < argc; ++i) {
+    if (parse_temper_option(argc, argv, &i, &temperature, &top_p)) continue;
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atol(argv[++i]);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) path = argv[++i];
+    else if (strcmp(argv[i], "--direct") == 0) kind = WRITE_DIRECT;
+    else if (strcmp(argv[i], "--mmap") == 0) kind = WRITE_MMAP;
+    else if (strcmp(argv[i], "--unique") == 0) unique = true;
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      const char *f = argv[++i];
+      if (strcmp(f, "text") == 0) format = FORMAT_TEXT;
+      else if (strcmp(f, "jsonl") == 0) format = FORMAT_JSONL;
+      else { fprintf(stderr, "gen: unknown format %s\n", f); return 2; }
+    } else if (strcmp(argv[i], "--novel") == 0 && i + 1 < argc) {
+      int max_copy = atoi(argv[++i]);
+      if (max_copy < 1) { fprintf(stderr, "--novel needs a span of at least 1 token\n"); return 2; }
+      build_novelty_index(m, (size_t)max_copy, &novel);
+      gp.novel = &novel;
+    } else { fprintf(stderr, "gen: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (threads < 1) threads = 1;
+  struct temper temper = {0};
+  if (temperature != 1.0 || top_p < 1.0) {
+    temper_init(&temper, m, temperature, top_p);
+    temper_fill(&temper, threads);
+    gp.temper = &temper;
+  }
+
+  struct writer w;
+  if (!writer_open(&w, path, kind)) return 1;
+  struct gen_job job = { .m = m, .gp = &gp, .w = &w, .format = format, .seed = seed, .count = count };
+  atomic_init(&job.next, 0);
+  atomic_init(&job.accepted, 0);
+  atomic_init(&job.misses, 0);
+  atomic_init(&job.dropped, 0);
+  struct unique_set *set = NULL;
+  if (unique) {
+    set = (struct unique_set *)xmalloc(sizeof *set);
+    unique_init(set);
+    job.unique = set;
+  }
+  run_threads(threads, gen_worker, &job);
+  writer_close(&w);
+  if (set) {
+    long got = atomic_load(&job.accepted);
+    if (got < count) fprintf(stderr, "gen: only %ld distinct sentences found (%ld duplicates in a row)\n", got, UNIQUE_GIVE_UP);
+    unique_free(set);
+    free(set);
+  }
+  int rc = 0;
+  long dropped = atomic_load(&job.dropped);
+  if (dropped > 0) {
+    fprintf(stderr, "gen: only %ld of %ld sentences written (%ld failed %d walks each)\n", count - dropped, count,
+            dropped, GEN_TRIES);
+    rc = 1;
+  }
+  temper_free(&temper);
+  free_novelty_index(&novel);
+  return rc;
+}
+
+// --------------------------- Streaming server ---------------------------
+
+// One thread multiplexes every client on epoll. A request
+//   GET /?n=SENTENCES&seed=S HTTP/1.1
+// is answered with a chunked text/plain body carrying one chunk per token as
+// the walker yields it. Each connection holds only a walker and a small
+// output buffer, and writable connections take turns of STREAM_BATCH tokens,
+// so a fast reader cannot starve the others.
+#define STREAM_BATCH 64
+#define STREAM_OUT 8192             // stop producing once this much is buffered
+#define STREAM_SENTENCE_BYTES 4096  // same cap as the buffered generators
+#define STREAM_MAX_SENTENCES 100000
+
+enum conn_state { CONN_REQUEST, CONN_STREAM, CONN_DRAIN };
+
+struct conn {
+  int fd;
+  enum conn_state state;
+  struct walker walk;
+  long sentences_left;
+  char in[2048];
+  size_t in_len;
+  struct outbuf out;
+  size_t out_off;
+};
+
+static void conn_puts(struct conn *c, const char *s, size_t n) {
+  outbuf_append(&c->out, s, n);
+}
+
+// Appends one HTTP chunk holding a and b.
+static void conn_chunk(struct conn *c, const char *a, const char *b) {
+  size_t na = strlen(a), nb = strlen(b);
+  char head[24];
+  conn_puts(c, head, (size_t)snprintf(head, sizeof head, "%zx\r\n", na + nb));
+  conn_puts(c, a, na);
+  conn_puts(c, b, nb);
+  conn_puts(c, "\r\n", 2);
+}
+
+// Parses the request line; false when it is not a GET.
+static bool conn_parse_request(const struct model *m, struct conn *c) {
+  if (strncmp(c->in, "GET ", 4) != 0) return false;
+  long n = 1;
+  uint64_t seed = fresh_seed() ^ (uint64_t)c->fd;
+  char *q = strchr(c->in + 4, '?');
+  char *line_end = strstr(c->in, "\r\n");
+  for (char *p = q; p && p < line_end && *p != ' '; p = strpbrk(p, "&? ")) {
+    ++p;
+    if (strncmp(p, "n=", 2) == 0) n = atol(p + 2);
+    else if (strncmp(p, "seed=", 5) == 0) seed = strtoull(p + 5, NULL, 0);
+  }
+  if (n < 1) n = 1;
+  if (n > STREAM_MAX_SENTENCES) n = STREAM_MAX_SENTENCES;
+  c->sentences_left = n;
+  walker_start(&c->walk, m, NULL, (struct rng){ mix64(seed) }, SIZE_MAX, NULL, STREAM_SENTENCE_BYTES);
+  return true;
+}
+
+// Fills the output buffer with up to STREAM_BATCH tokens.
+static void conn_produce(struct conn *c) {
+  for (int i = 0; i < STREAM_BATCH && c->state == CONN_STREAM && c->out.len < STREAM_OUT; ++i) {
+    struct walk_token tok;
+    enum walk_status st = walker_next(&c->walk, &tok);
+    if (st == WALK_TOKEN) {
+      conn_chunk(c, tok.sep, tok.text);
+      continue;
+    }
+    // WALK_REJECT only happens without tokens for the plain walk: skip it.
+    if (st == WALK_END) conn_chunk(c, "\n", "");
+    size_t after = st == WALK_END ? c->walk.curr : SIZE_MAX;
+    if (st == WALK_END && --c->sentences_left == 0) {
+      conn_puts(c, "0\r\n\r\n", 5);
+      c->state = CONN_DRAIN;
+      break;
+    }
+    walker_start(&c->walk, c->walk.m, NULL, c->walk.rng, after, NULL, c->walk.max_chars);
+  }
+}
+
+// Writes what the socket takes. False when the connection is finished or broken.
+static bool conn_flush(struct conn *c) {
+  while (c->out_off < c->out.len) {
+    ssize_t n = send(c->fd, c->out.data + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    c->out_off += (size_t)n;
+  }
+  c->out_off = c->out.len = 0;
+  return c->state != CONN_DRAIN;
+}
+
+static void conn_close(int ep, struct conn *c) {
+  epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->out.data);
+  free(c);
+}
+
+// frankentext serve [--port P]
+static int cmd_serve(const struct model *m, int argc, char **argv) {
+  int port = 8080;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+    else { fprintf(stderr, "serve: unknown option %s\n", argv[i]); return 2; }
+  }
+  int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (lfd < 0) { perror("socket"); return 1; }
+  int one = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port),
+                              .sin_addr.s_addr = htonl(INADDR_ANY) };
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(lfd, SOMAXCONN) != 0) {
+    perror("bind");
+    close(lfd);
+    return 1;
+  }
+  int ep = epoll_create1(0);
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+  fprintf(stderr, "listening on port %d\n", port);
+
+  struct epoll_event events[256];
+  for (;;) {
+    int ready = epoll_wait(ep, events, 256, -1);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < ready; ++i) {
+      struct conn *c = (struct conn *)events[i].data.ptr;
+      if (!c) {
+        int fd;
+        while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+          c = (struct conn *)calloc(1, sizeof *c);
+          if (!c) { close(fd); continue; }
+          c->fd = fd;
+          struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+          epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+        }
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) { conn_close(ep, c); continue; }
+      if (c->state == CONN_REQUEST) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof c->in - 1 - c->in_len, 0);
+        if (n <= 0) {
+          if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+          conn_close(ep, c);
+          continue;
+        }
+        c->in_len += (size_t)n;
+        c->in[c->in_len] = '\0';
+        if (!strstr(c->in, "\r\n\r\n")) {
+          if (c->in_len == sizeof c->in - 1) conn_close(ep, c);
+          continue;
+        }
+        if (!conn_parse_request(m, c)) {
+          static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+          conn_puts(c, bad, sizeof bad - 1);
+          c->state = CONN_DRAIN;
+        } else {
+          static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                                   "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+          conn_puts(c, ok, sizeof ok - 1);
+          c->state = CONN_STREAM;
+        }
+        struct epoll_event cev = { .events = EPOLLOUT, .data.ptr = c };
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &cev);
+        continue;
+      }
+      if (c->out.len == 0 && c->state == CONN_STREAM) conn_produce(c);
+      if (!conn_flush(c)) conn_close(ep, c);
+    }
+  }
+  close(ep);
+  close(lfd);
+  return 1;
+}
+
+// --------------------------- Character model ---------------------------
+
+// Character n-gram model over the same sanitized book: a state is the last
+// `order` bytes packed into an integer (newest byte lowest), with whitespace
+// runs collapsed to one space. Each state stores its successor bytes with
+// cumulative counts and the id of the state each byte leads to, so a walk
+// never hashes: one row read, one draw, one table step per character.
+// Rows with many distinct bytes are dense (256 entries, binary searched);
+// the rest are sparse (only the bytes seen, scanned linearly).
+#define CHAR_MAX_ORDER 8
+#define CHAR_DENSE_FANOUT 32
+
+struct char_state {
+  uint32_t total;  // transitions out of this state
+  uint32_t off;    // into sparse arrays, or dense row index * 256
+  uint16_t n;      // distinct successor bytes (sparse)
+  uint8_t dense;
+};
+
+struct char_model {
+  unsigned order;
+  uint64_t mask;
+  size_t n_states;
+  uint64_t *keys;            // keys[state]
+  struct char_state *states;
+  uint8_t *sp_byte;          // sparse rows
+  uint32_t *sp_cum;
+  uint32_t *sp_next;
+  uint32_t *dn_cum;          // dense rows, 256 entries each
+  uint32_t *dn_next;
+  // Start states for words (context ends in a space) and sentences
+  // (context ends in a terminal and a space), weighted by frequency.
+  uint32_t *word_start, *sent_start;
+  uint64_t *word_cum, *sent_cum;
+  size_t n_word_start, n_sent_start;
+};
+
+// Open-addressing map from packed keys to state ids, used only while building.
+struct key_map {
+  uint64_t *keys;
+  uint32_t *vals;  // UINT32_MAX = empty
+  size_t mask, used;
+};
+
+static void key_map_init(struct key_map *km, size_t cap) {
+  km->keys = (uint64_t *)xmalloc(cap * sizeof(uint64_t));
+  km->vals = (uint32_t *)xmalloc(cap * sizeof(uint32_t));
+  for (size_t i = 0; i < cap; ++i) km->vals[i] = UINT32_MAX;
+  km->mask = cap - 1;
+  km->used = 0;
+}
+
+static uint32_t *key_map_slot(struct key_map *km, uint64_t key) {
+  for (size_t i = mix64(key) & km->mask;; i = (i + 1) & km->mask) {
+    if (km->vals[i] == UINT32_MAX || km->keys[i] == key) {
+      km->keys[i] = key;
+      return &km->vals[i];
+    }
+  }
+}
+
+static uint32_t *key_map_get(struct key_map *km, uint64_t key) {
+  if (2 * (km->used + 1) > km->mask + 1) {
+    struct key_map big;
+    key_map_init(&big, 2 * (km->mask + 1));
+    for (size_t i = 0; i <= km->mask; ++i) {
+      if (km->vals[i] != UINT32_MAX) *key_map_slot(&big, km->keys[i]) = km->vals[i];
+    }
+    big.used = km->used;
+    free(km->keys);
+    free(km->vals);
+    *km = big;
+  }
+  uint32_t *v = key_map_slot(km, key);
+  if (*v == UINT32_MAX) km->used++;
+  return v;
+}
+
+static void key_map_free(struct key_map *km) {
+  free(km->keys);
+  free(km->vals);
+}
+
+static void build_char_model(struct char_model *cm, const char *text, size_t len, unsigned order) {
+  memset(cm, 0, sizeof *cm);
+  cm->order = order;
+  cm->mask = order == 8 ? ~0ULL : ((1ULL << (8 * order)) - 1);
+
+  struct key_map states, trans;    // key -> state id; (state << 8 | byte) -> count
+  key_map_init(&states, 1024);
+  key_map_init(&trans, 1024);
+  size_t keys_cap = 1024;
+  cm->keys = (uint64_t *)xmalloc(keys_cap * sizeof(uint64_t));
+
+  uint64_t key = 0x2020202020202020ULL & cm->mask; // the book starts after whitespace
+  uint32_t *slot = key_map_get(&states, key);
+  *slot = 0;
+  cm->keys[cm->n_states++] = key;
+  uint32_t cur = 0;
+  unsigned char last = ' ';
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = is_delim((unsigned char)text[i]) ? ' ' : (unsigned char)text[i];
+    if (c == ' ' && last == ' ') continue;
+    last = c;
+    uint32_t *count = key_map_get(&trans, ((uint64_t)cur << 8) | c);
+    *count = *count == UINT32_MAX ? 1 : *count + 1;
+    key = ((key << 8) | c) & cm->mask;
+    slot = key_map_get(&states, key);
+    if (*slot == UINT32_MAX) {
+      if (cm->n_states == keys_cap) cm->keys = (uint64_t *)xrealloc(cm->keys, (keys_cap *= 2) * sizeof(uint64_t));
+      *slot = (uint32_t)cm->n_states;
+      cm->keys[cm->n_states++] = key;
+    }
+    cur = *slot;
+  }
+
+  // Group transitions by state (bytes ascending) and lay out the rows.
+  size_t n_trans = trans.used, k = 0;
+  uint64_t *pairs = (uint64_t *)xmalloc(n_trans * sizeof(uint64_t));
+  for (size_t i = 0; i <= trans.mask; ++i) {
+    if (trans.vals[i] != UINT32_MAX) pairs[k++] = trans.keys[i];
+  }
+  qsort(pairs, n_trans, sizeof(uint64_t), cmp_u64);
+
+  cm->states = (struct char_state *)calloc(cm->n_states, sizeof(struct char_state));
+  if (!cm->states) { fprintf(stderr, "OOM\n"); exit(1); }
+  size_t n_sparse = 0, n_dense = 0;
+  for (size_t i = 0; i < n_trans;) {
+    size_t j = i;
+    while (j < n_trans && (pairs[j] >> 8) == (pairs[i] >> 8)) ++j;
+    struct char_state *st = &cm->states[pairs[i] >> 8];
+    st->dense = j - i > CHAR_DENSE_FANOUT;
+    st->n = (uint16_t)(j - i);
+    if (st->dense) n_dense++;
+    else n_sparse += j - i;
+    i = j;
+  }
+  cm->sp_byte = (uint8_t *)xmalloc(n_sparse);
+  cm->sp_cum = (uint32_t *)xmalloc(n_sparse * sizeof(uint32_t));
+  cm->sp_next = (uint32_t *)xmalloc(n_sparse * sizeof(uint32_t));
+  cm->dn_cum = (uint32_t *)xmalloc(n_dense * 256 * sizeof(uint32_t));
+  cm->dn_next = (uint32_t *)xmalloc(n_dense * 256 * sizeof(uint32_t));
+  size_t sp = 0, dn = 0;
+  for (size_t i = 0; i < n_trans;) {
+    uint32_t s = (uint32_t)(pairs[i] >> 8);
+    struct char_state *st = &cm->states[s];
+    uint32_t total = 0;
+    if (st->dense) {
+      st->off = (uint32_t)(dn++ * 256);
+      for (unsigned b = 0; b < 256; ++b) cm->dn_next[st->off + b] = UINT32_MAX;
+    } else {
+      st->off = (uint32_t)sp;
+    }
+    for (; i < n_trans && (pairs[i] >> 8) == s; ++i) {
+      unsigned char c = (unsigned char)(pairs[i] & 0xFF);
+      total += *key_map_get(&trans, pairs[i]);
+      uint32_t next = *key_map_get(&states, ((cm->keys[s] << 8) | c) & cm->mask);
+      if (st->dense) {
+        cm->dn_next[st->off + c] = next;
+        cm->dn_cum[st->off + c] = total;
+      } else {
+        cm->sp_byte[sp] = c;
+        cm->sp_cum[sp] = total;
+        cm->sp_next[sp++] = next;
+      }
+    }
+    if (st->dense) {
+      // Absent bytes repeat the running total, so they are never selected.
+      uint32_t run = 0;
+      for (unsigned b = 0; b < 256; ++b) {
+        if (cm->dn_next[st->off + b] == UINT32_MAX) cm->dn_cum[st->off + b] = run;
+        else run = cm->dn_cum[st->off + b];
+      }
+    }
+    st->total = total;
+  }
+  free(pairs);
+  key_map_free(&trans);
+  key_map_free(&states);
+
+  cm->word_start = (uint32_t *)xmalloc(cm->n_states * sizeof(uint32_t));
+  cm->sent_start = (uint32_t *)xmalloc(cm->n_states * sizeof(uint32_t));
+  cm->word_cum = (uint64_t *)xmalloc(cm->n_states * sizeof(uint64_t));
+  cm->sent_cum = (uint64_t *)xmalloc(cm->n_states * sizeof(uint64_t));
+  uint64_t wsum = 0, ssum = 0;
+  for (size_t s = 0; s < cm->n_states; ++s) {
+    uint64_t kk = cm->keys[s];
+    if (cm->states[s].total == 0 || (kk & 0xFF) != ' ') continue;
+    cm->word_start[cm->n_word_start] = (uint32_t)s;
+    cm->word_cum[cm->n_word_start++] = wsum += cm->states[s].total;
+    if (order == 1 || is_terminal_char((char)((kk >> 8) & 0xFF))) {
+      cm->sent_start[cm->n_sent_start] = (uint32_t)s;
+      cm->sent_cum[cm->n_sent_start++] = ssum += cm->states[s].total;
+    }
+  }
+}
+
+static void free_char_model(struct char_model *cm) {
+  free(cm->keys);
+  free(cm->states);
+  free(cm->sp_byte);
+  free(cm->sp_cum);
+  free(cm->sp_next);
+  free(cm->dn_cum);
+  free(cm->dn_next);
+  free(cm->word_start);
+  free(cm->sent_start);
+  free(cm->word_cum);
+  free(cm->sent_cum);
+}
+
+// One transition: emits a byte and returns the next state, or UINT32_MAX at
+// a dead end (the last context of the book).
+static inline uint32_t char_step(const struct char_model *cm, uint32_t s, struct rng *r, unsigned char *out) {
+  const struct char_state *st = &cm->states[s];
+  if (st->total == 0) return UINT32_MAX;
+  uint32_t x = rng_below(r, st->total);
+  if (st->dense) {
+    // Branch-free binary search: eight dependent loads, no mispredictions.
+    const uint32_t *cum = cm->dn_cum + st->off;
+    unsigned lo = 0;
+    for (unsigned half = 128; half; half >>= 1) {
+      lo += half & -(unsigned)(cum[lo + half - 1] <= x);
+    }
+    *out = (unsigned char)lo;
+    return cm->dn_next[st->off + lo];
+  }
+  const uint32_t *cum = cm->sp_cum + st->off;
+  unsigned j = 0;
+  while (cum[j] <= x) ++j;
+  *out = cm->sp_byte[st->off + j];
+  return cm->sp_next[st->off + j];
+}
+
+// Draws from a start table by total weight; UINT32_MAX if the table is empty.
+static uint32_t char_pick_start(const uint32_t *ids, const uint64_t *cum, size_t n, struct rng *r) {
+  if (n == 0 || cum[n - 1] == 0) return UINT32_MAX;
+  uint64_t x = rng_next(r) % cum[n - 1];
+  size_t lo = 0, hi = n - 1;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cum[mid] <= x) lo = mid + 1;
+    else hi = mid;
+  }
+  return ids[lo];
+}
+
+// frankentext chars [-n ORDER] [--words K | --sentences K] [--bench STEPS]
+static int cmd_chars(int argc, char **argv) {
+  unsigned order = 4;
+  long words = 0, sentences = 3, bench = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) order = (unsigned)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--words") == 0 && i + 1 < argc) { words = atol(argv[++i]); sentences = 0; }
+    else if (strcmp(argv[i], "--sentences") == 0 && i + 1 < argc) { sentences = atol(argv[++i]); words = 0; }
+    else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) bench = atol(argv[++i]);
+    else { fprintf(stderr, "chars: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (order < 1 || order > CHAR_MAX_ORDER) { fprintf(stderr, "chars: order must be 1..%d\n", CHAR_MAX_ORDER); return 2; }
+
+  load_book();
+  struct char_model cm;
+  build_char_model(&cm, book_mut, strlen(book_mut), order);
+  release_book();
+  // The bench and --words draw from word starts, --sentences from sentence starts.
+  size_t n_start = bench > 0 || words ? cm.n_word_start : cm.n_sent_start;
+  if (n_start == 0) { fprintf(stderr, "chars: corpus too small\n"); free_char_model(&cm); return 1; }
+
+  struct rng r = { fresh_seed() };
+  if (bench > 0) {
+    struct timespec t0, t1;
+    unsigned char c = 0, sink = 0;
+    uint32_t s = char_pick_start(cm.word_start, cm.word_cum, cm.n_word_start, &r);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < bench; ++i) {
+      s = char_step(&cm, s, &r, &c);
+      sink ^= c;
+      if (s == UINT32_MAX) s = cm.word_start[0];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double sec = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    printf("%ld transitions in %.3f s: %.1f M/s (%zu states, checksum %u)\n",
+           bench, sec, (double)bench / sec / 1e6, cm.n_states, sink);
+    free_char_model(&cm);
+    return 0;
+  }
+
+  char buf[4096];
+  long units = words ? words : sentences;
+  for (long u = 0; u < units; ++u) {
+    uint32_t s = words ? char_pick_start(cm.word_start, cm.word_cum, cm.n_word_start, &r)
+                       : char_pick_start(cm.sent_start, cm.sent_cum, cm.n_sent_start, &r);
+    size_t n = 0;
+    unsigned char c;
+    while (n + 1 < sizeof buf && (s = char_step(&cm, s, &r, &c)) != UINT32_MAX) {
+      if (words && c == ' ') break;
+      buf[n++] = (char)c;
+      if (!words && is_terminal_char((char)c)) break;
+    }
+    buf[n++] = '\n';
+    fwrite(buf, 1, n, stdout);
+  }
+  free_char_model(&cm);
+  return 0;
+}
+
+// --------------------------- Chain analytics ---------------------------
+
+// Treats the successor counts as a sparse transition matrix P (row v is
+// count(v, w) / total(v)) and iterates on it with all threads:
+//   stationary:  pi <- pi P, pulled through the transposed matrix so each
+//                thread owns a block of output rows and never synchronizes
+//                inside a sweep. Mass that reaches a dead end restarts at the
+//                sentence starts, as the walk does.
+//   length:      L(v) = 1 for terminal and dead-end tokens, else
+//                1 + sum_w P(w | v) L(w): expected tokens left in a sentence.
+// The ratio of successive residuals of the power iteration estimates |lambda2|,
+// whose gap 1 - |lambda2| sets how fast walks forget where they started.
+#define CHAIN_ROWS_PER_TASK 2048
+#define CHAIN_LENGTH_TOL 1e-6 // relative; lengths are reported to two decimals
+
+enum chain_sweep { CHAIN_STATIONARY, CHAIN_LENGTH };
+
+struct chain {
+  const struct model *m;
+  size_t n;
+  // Transposed transitions: the predecessors of w and P(w | v) for each, in
+  // [in_off[w], in_off[w + 1]).
+  uint32_t *in_off;
+  uint32_t *in_src;
+  double *in_p;
+  uint8_t *dead;       // no successors
+  uint8_t *terminal;   // ends a sentence
+  double *restart;     // where dead-end mass goes: uniform over sentence starts
+};
+
+struct chain_job {
+  const struct chain *c;
+  enum chain_sweep sweep;
+  int threads;
+  atomic_int thread_ids;
+  pthread_barrier_t barrier;
+  double *x, *y;
+  size_t max_iters;
+  double tol;
+  struct { double dead, diff; char pad[48]; } *partial; // per thread
+  size_t iters;
+  double residual, prev_residual, lambda2;
+  bool stop;
+};
+
+static void build_chain(struct chain *c, const struct model *m) {
+  size_t n = m->n_states;
+  c->m = m;
+  c->n = n;
+  size_t edges = m->row_off[n];
+  c->in_off = (uint32_t *)calloc(n + 1, sizeof(uint32_t));
+  if (!c->in_off) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (size_t j = 0; j < edges; ++j) c->in_off[m->succ_id[j] + 1]++;
+  for (size_t w = 0; w < n; ++w) c->in_off[w + 1] += c->in_off[w];
+  c->in_src = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+  c->in_p = (double *)xmalloc((edges ? edges : 1) * sizeof(double));
+  uint32_t *fill = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  memcpy(fill, c->in_off, n * sizeof(uint32_t));
+  c->dead = (uint8_t *)xmalloc(n ? n : 1);
+  c->terminal = (uint8_t *)xmalloc(n ? n : 1);
+  c->restart = (double *)xmalloc((n ? n : 1) * sizeof(double));
+  size_t starts = 0;
+  for (size_t v = 0; v < n; ++v) starts += can_start(m, v);
+  for (size_t v = 0; v < n; ++v) {
+    uint32_t total = row_total(m, v);
+    c->dead[v] = total == 0;
+    c->terminal[v] = m->hot[v].end != 0;
+    c->restart[v] = starts ? (can_start(m, v) ? 1.0 / (double)starts : 0.0) : 1.0 / (double)n;
+    for (uint32_t j = m->row_off[v]; j < m->row_off[v + 1]; ++j) {
+      uint32_t k = fill[m->succ_id[j]]++;
+      c->in_src[k] = (uint32_t)v;
+      c->in_p[k] = (double)m->succ_count[j] / (double)total;
+    }
+  }
+  free(fill);
+}
+
+static void free_chain(struct chain *c) {
+  free(c->in_off);
+  free(c->in_src);
+  free(c->in_p);
+  free(c->dead);
+  free(c->terminal);
+  free(c->restart);
+}
+
+// sum_k p[k] * x[src[k]] with four independent accumulators: the loads are
+// gathers, so the win is in overlapping them rather than in wide arithmetic.
+static inline double gather_dot(const double *p, const uint32_t *src, const double *x, uint32_t lo, uint32_t hi) {
+  double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+  uint32_t k = lo;
+  for (; k + 4 <= hi; k += 4) {
+    s0 += p[k] * x[src[k]];
+    s1 += p[k + 1] * x[src[k + 1]];
+    s2 += p[k + 2] * x[src[k + 2]];
+    s3 += p[k + 3] * x[src[k + 3]];
+  }
+  for (; k < hi; ++k) s0 += p[k] * x[src[k]];
+  return (s0 + s1) + (s2 + s3);
+}
+
+// Expected length step for row v, over the forward rows of the model.
+static inline double length_step(const struct chain *c, const double *x, size_t v) {
+  const struct model *m = c->m;
+  if (c->terminal[v] || c->dead[v]) return 1.0;
+  double s = 0.0;
+  for (uint32_t j = m->row_off[v]; j < m->row_off[v + 1]; ++j) s += (double)m->succ_count[j] * x[m->succ_id[j]];
+  return 1.0 + s / (double)row_total(m, v);
+}
+
+static void *chain_worker(void *arg) {
+  struct chain_job *job = (struct chain_job *)arg;
+  const struct chain *c = job->c;
+  int me = atomic_fetch_add(&job->thread_ids, 1);
+  size_t per = (c->n + (size_t)job->threads - 1) / (size_t)job->threads;
+  size_t lo = (size_t)me * per < c->n ? (size_t)me * per : c->n;
+  size_t hi = lo + per < c->n ? lo + per : c->n;
+  for (;;) {
+    const double *x = job->x;
+    double *y = job->y;
+    if (job->sweep == CHAIN_STATIONARY) {
+      double dead = 0.0;
+      for (size_t v = lo; v < hi; ++v) dead += c->dead[v] ? x[v] : 0.0;
+      job->partial[me].dead = dead;
+      pthread_barrier_wait(&job->barrier);
+      dead = 0.0;
+      for (int t = 0; t < job->threads; ++t) dead += job->partial[t].dead;
+      double diff = 0.0;
+      for (size_t w = lo; w < hi; ++w) {
+        y[w] = gather_dot(c->in_p, c->in_src, x, c->in_off[w], c->in_off[w + 1]) + dead * c->restart[w];
+        diff += fabs(y[w] - x[w]);
+      }
+      job->partial[me].diff = diff;
+    } else {
+      double diff = 0.0;
+      for (size_t v = lo; v < hi; ++v) {
+        y[v] = length_step(c, x, v);
+        double d = fabs(y[v] - x[v]) / y[v];
+        if (d > diff) diff = d;
+      }
+      job->partial[me].diff = diff;
+    }
+    if (pthread_barrier_wait(&job->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      double r = 0.0;
+      for (int t = 0; t < job->threads; ++t) {
+        r = job->sweep == CHAIN_STATIONARY ? r + job->partial[t].diff
+                                           : (job->partial[t].diff > r ? job->partial[t].diff : r);
+      }
+      job->prev_residual = job->residual;
+      job->residual = r;
+      if (job->sweep == CHAIN_STATIONARY && job->iters > 0 && job->prev_residual > 0.0) {
+        job->lambda2 = r / job->prev_residual;
+      }
+      job->iters++;
+      job->x = y;
+      job->y = (double *)x;
+      job->stop = r <= job->tol || job->iters >= job->max_iters;
+    }
+    pthread_barrier_wait(&job->barrier);
+    if (job->stop) break;
+  }
+  return NULL;
+}
+
+// Iterates sweep from x0 until the residual is at most tol; the result is in
+// job->x on return (x0 or scratch, whichever the last sweep wrote).
+static void chain_iterate(struct chain_job *job, const struct chain *c, enum chain_sweep sweep, int threads,
+                          double *x0, double *scratch, size_t max_iters, double tol) {
+  memset(job, 0, sizeof *job);
+  job->c = c;
+  job->sweep = sweep;
+  job->threads = threads;
+  job->x = x0;
+  job->y = scratch;
+  job->max_iters = max_iters;
+  job->tol = tol;
+  job->partial = xmalloc((size_t)threads * sizeof *job->partial);
+  atomic_init(&job->thread_ids, 0);
+  pthread_barrier_init(&job->barrier, NULL, (unsigned)threads);
+  run_threads(threads, chain_worker, job);
+  pthread_barrier_destroy(&job->barrier);
+  free(job->partial);
+}
+
+static double row_entropy(const struct model *m, size_t v) {
+  uint32_t total = row_total(m, v);
+  double h = 0.0;
+  for (uint32_t j = m->row_off[v]; j < m->row_off[v + 1]; ++j) {
+    double p = (double)m->succ_count[j] / (double)total;
+    h -= p * log2(p);
+  }
+  return h;
+}
+
+static int cmp_double_idx_desc(const void *a, const void *b, void *arg) {
+  const double *key = (const double *)arg;
+  double x = key[*(const uint32_t *)a], y = key[*(const uint32_t *)b];
+  return (x < y) - (x > y);
+}
+
+// frankentext chain [-j N] [--iters K] [--tol E] [--top K]
+static int cmd_chain(const struct model *m, int argc, char **argv) {
+  int threads = default_threads();
+  size_t max_iters = 1000, top = 10;
+  double tol = 1e-10;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc) max_iters = (size_t)atol(argv[++i]);
+    else if (strcmp(argv[i], "--tol") == 0 && i + 1 < argc) tol = atof(argv[++i]);
+    else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = (size_t)atol(argv[++i]);
+    else { fprintf(stderr, "chain: unknown option %s\n", argv[i]); return 2; }
+  }
+  size_t n = m->n_states;
+  if (n == 0) { fprintf(stderr, "chain: empty model\n"); return 1; }
+  if (threads < 1) threads = 1;
+  if ((size_t)threads > n / CHAIN_ROWS_PER_TASK + 1) threads = (int)(n / CHAIN_ROWS_PER_TASK + 1);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  struct chain c;
+  build_chain(&c, m);
+  size_t dead = 0, terminal = 0;
+  for (size_t v = 0; v < n; ++v) { dead += c.dead[v]; terminal += c.terminal[v]; }
+  printf("states\t%zu\ndistinct bigrams\t%u\ndead ends\t%zu\nterminal\t%zu\n", n, m->row_off[n], dead, terminal);
+
+  // Stationary distribution, from uniform.
+  double *a = (double *)xmalloc(n * sizeof(double)), *b = (double *)xmalloc(n * sizeof(double));
+  for (size_t v = 0; v < n; ++v) a[v] = 1.0 / (double)n;
+  struct chain_job job;
+  chain_iterate(&job, &c, CHAIN_STATIONARY, threads, a, b, max_iters, tol);
+  double *pi = job.x;
+  double l1_freq = 0.0;
+  for (size_t v = 0; v < n; ++v) l1_freq += fabs(pi[v] - (double)m->freq[v] / (double)m->n_tokens);
+  printf("power iterations\t%zu\nresidual (L1)\t%.3g\n", job.iters, job.residual);
+  printf("|lambda2| estimate\t%.6f\n", job.lambda2);
+  if (job.lambda2 < 1.0) printf("relaxation time\t%.1f steps\n", 1.0 / (1.0 - job.lambda2));
+  else printf("relaxation time\tunbounded (periodic or reducible chain)\n");
+  printf("L1 to unigram frequencies\t%.4g\n", l1_freq);
+
+  // Entropy of each row, and the entropy rate under pi.
+  double rate = 0.0, mean_h = 0.0, max_h = 0.0;
+  size_t max_v = 0, live = 0;
+  for (size_t v = 0; v < n; ++v) {
+    if (c.dead[v]) continue;
+    double h = row_entropy(m, v);
+    rate += pi[v] * h;
+    mean_h += h;
+    ++live;
+    if (h > max_h) { max_h = h; max_v = v; }
+  }
+  printf("entropy rate\t%.4f bits/token\n", rate);
+  printf("mean row entropy\t%.4f bits\n", live ? mean_h / (double)live : 0.0);
+  printf("max row entropy\t%.4f bits (%s)\n", max_h, surface(m, max_v));
+
+  uint32_t *order = (uint32_t *)xmalloc(n * sizeof(uint32_t));
+  for (size_t v = 0; v < n; ++v) order[v] = (uint32_t)v;
+  qsort_r(order, n, sizeof(uint32_t), cmp_double_idx_desc, pi);
+  printf("top stationary states:\n");
+  for (size_t i = 0; i < top && i < n; ++i) {
+    printf("  %.6f\t%s\n", pi[order[i]], surface(m, order[i]));
+  }
+
+  // Expected remaining sentence length, from L = 1.
+  double *pi_copy = (double *)xmalloc(n * sizeof(double));
+  memcpy(pi_copy, pi, n * sizeof(double));
+  for (size_t v = 0; v < n; ++v) a[v] = 1.0;
+  chain_iterate(&job, &c, CHAIN_LENGTH, threads, a, b, max_iters * 10, CHAIN_LENGTH_TOL);
+  const double *len = job.x;
+  double from_start = 0.0;
+  size_t starts = 0;
+  for (size_t v = 0; v < n; ++v) {
+    if (can_start(m, v)) { from_start += len[v]; ++starts; }
+  }
+  printf("length iterations\t%zu\nresidual (max relative)\t%.3g\n", job.iters, job.residual);
+  printf("expected sentence length\t%.2f tokens (uniform start, as generated)\n",
+         starts ? from_start / (double)starts : 0.0);
+  for (size_t i = 0; i < top && i < n; ++i) {
+    printf("  %.2f\tafter %s\n", len[order[i]], surface(m, order[i]));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr, "chain: %.3f s on %d threads\n",
+          (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9, threads);
+  free(pi_copy);
+  free(order);
+  free(a);
+  free(b);
+  free_chain(&c);
+  return 0;
+}
+
+// --------------------------- Statistics ---------------------------
+
+// One pass over the frozen states, split into blocks pulled by the threads.
+// Every thread aggregates into its own struct stats_part (histograms and a
+// bounded min-heap of its most frequent tokens); the parts are merged once at
+// the end, the heaps by pushing every entry through one more bounded heap.
+#define STATS_BLOCK 8192
+#define FANOUT_BUCKETS 34 // 0, 1, 2, 3-4, 5-8, ..., up to 2^32
+
+struct top_entry {
+  uint32_t freq;
+  uint32_t id;
+};
+
+struct stats_part {
+  uint64_t fanout[FANOUT_BUCKETS]; // states by distinct successor count
+  uint64_t terminal[256];          // corpus occurrences of sentence-ending tokens, by last char
+  uint64_t hapax;                  // states seen once
+  uint64_t dead;                   // states without successors
+  uint32_t widest, widest_id;      // largest fan-out and its state
+  struct top_entry *heap;          // min-heap of the top entries so far
+  size_t heap_n;
+};
+
+struct stats_job {
+  const struct model *m;
+  size_t top;
+  struct stats_part *parts;
+  atomic_int thread_ids;
+  atomic_size_t next;
+};
+
+// Ranks by frequency, then by smaller id: a < b when a ranks below b.
+static int cmp_top_asc(const void *a, const void *b) {
+  struct top_entry x = *(const struct top_entry *)a, y = *(const struct top_entry *)b;
+  if (x.freq != y.freq) return x.freq < y.freq ? -1 : 1;
+  return (x.id < y.id) - (x.id > y.id);
+}
+
+// Offers e to a min-heap holding at most cap entries.
+static inline void top_push(struct top_entry *h, size_t *n, size_t cap, struct top_entry e) {
+  heap_offer(h, n, cap, sizeof e, &e, cmp_top_asc);
+}
+
+static inline unsigned fanout_bucket(uint32_t k) {
+  return k == 0 ? 0 : 1 + (unsigned)(k == 1 ? 0 : 32 - __builtin_clz(k - 1));
+}
+
+static void *stats_worker(void *arg) {
+  struct stats_job *job = (struct stats_job *)arg;
+  const struct model *m = job->m;
+  struct stats_part *p = &job->parts[atomic_fetch_add(&job->thread_ids, 1)];
+  for (;;) {
+    size_t first = atomic_fetch_add(&job->next, STATS_BLOCK);
+    if (first >= m->n_states) break;
+    size_t end = first + STATS_BLOCK < m->n_states ? first + STATS_BLOCK : m->n_states;
+    for (size_t v = first; v < end; ++v) {
+      uint32_t k = m->row_off[v + 1] - m->row_off[v];
+      p->fanout[fanout_bucket(k)]++;
+      p->dead += k == 0;
+      if (k > p->widest) { p->widest = k; p->widest_id = (uint32_t)v; }
+      p->hapax += m->freq[v] == 1;
+      if (m->hot[v].end) p->terminal[m->hot[v].end] += m->freq[v];
+      top_push(p->heap, &p->heap_n, job->top, (struct top_entry){ m->freq[v], (uint32_t)v });
+    }
+  }
+  return NULL;
+}
+
+static int cmp_top_desc(const void *a, const void *b) {
+  return cmp_top_asc(b, a);
+}
+
+// frankentext stats [-j N] [--top N]
+static int cmd_stats(const struct model *m, int argc, char **argv) {
+  int threads = default_threads();
+  size_t top = 20;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = (size_t)atol(argv[++i]);
+    else { fprintf(stderr, "stats: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (threads < 1) threads = 1;
+
+  struct stats_job job = { .m = m, .top = top };
+  job.parts = (struct stats_part *)calloc((size_t)threads, sizeof *job.parts);
+  if (!job.parts) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (int t = 0; t < threads; ++t) job.parts[t].heap = (struct top_entry *)xmalloc((top ? top : 1) * sizeof(struct top_entry));
+  atomic_init(&job.thread_ids, 0);
+  atomic_init(&job.next, 0);
+  run_threads(threads, stats_worker, &job);
+
+  struct stats_part all = {0};
+  all.heap = (struct top_entry *)xmalloc((top ? top : 1) * sizeof(struct top_entry));
+  for (int t = 0; t < threads; ++t) {
+    const struct stats_part *p = &job.parts[t];
+    for (size_t b = 0; b < FANOUT_BUCKETS; ++b) all.fanout[b] += p->fanout[b];
+    for (size_t c = 0; c < 256; ++c) all.terminal[c] += p->terminal[c];
+    all.hapax += p->hapax;
+    all.dead += p->dead;
+    if (p->widest > all.widest || (p->widest == all.widest && p->widest_id < all.widest_id)) {
+      all.widest = p->widest;
+      all.widest_id = p->widest_id;
+    }
+    for (size_t i = 0; i < p->heap_n; ++i) top_push(all.heap, &all.heap_n, top, p->heap[i]);
+    free(p->heap);
+  }
+  free(job.parts);
+
+  size_t n = m->n_states;
+  uint64_t bigrams = m->row_off[n], transitions = m->occ_off[n];
+  printf("tokens\t%llu\n", (unsigned long long)m->n_tokens);
+  printf("vocabulary\t%zu\n", n);
+  printf("type/token ratio\t%.6f\n", m->n_tokens ? (double)n / (double)m->n_tokens : 0.0);
+  printf("hapax legomena\t%llu\n", (unsigned long long)all.hapax);
+  printf("transitions\t%llu\n", (unsigned long long)transitions);
+  printf("distinct bigrams\t%llu\n", (unsigned long long)bigrams);
+  printf("mean fan-out\t%.3f\n", n ? (double)bigrams / (double)n : 0.0);
+  if (n) printf("max fan-out\t%u (%s)\n", all.widest, surface(m, all.widest_id));
+  printf("dead ends\t%llu\n", (unsigned long long)all.dead);
+
+  printf("fan-out distribution:\n");
+  for (size_t b = 0; b < FANOUT_BUCKETS; ++b) {
+    if (!all.fanout[b]) continue;
+    uint64_t lo = b < 2 ? b : (1ULL << (b - 2)) + 1, hi = b < 2 ? b : 1ULL << (b - 1);
+    char range[48];
+    if (lo == hi) snprintf(range, sizeof range, "%llu", (unsigned long long)lo);
+    else snprintf(range, sizeof range, "%llu-%llu", (unsigned long long)lo, (unsigned long long)hi);
+    printf("  %s\t%llu\t%.2f%%\n", range, (unsigned long long)all.fanout[b], 100.0 * (double)all.fanout[b] / (double)n);
+  }
+
+  uint64_t sentences = 0;
+  for (size_t c = 0; c < 256; ++c) sentences += all.terminal[c];
+  printf("sentence endings\t%llu\n", (unsigned long long)sentences);
+  for (size_t c = 0; c < 256; ++c) {
+    if (!all.terminal[c]) continue;
+    printf("  %c\t%llu\t%.2f%%\n", (int)c, (unsigned long long)all.terminal[c], 100.0 * (double)all.terminal[c] / (double)sentences);
+  }
+
+  qsort(all.heap, all.heap_n, sizeof(struct top_entry), cmp_top_desc);
+  printf("top %zu tokens:\n", all.heap_n);
+  for (size_t i = 0; i < all.heap_n; ++i) {
+    printf("  %u\t%.3f%%\t%s\n", all.heap[i].freq, 100.0 * all.heap[i].freq / (double)m->n_tokens, surface(m, all.heap[i].id));
+  }
+  free(all.heap);
+  return 0;
+}
+
+// --------------------------- Walk benchmark ---------------------------
+
+// `frankentext bench [--steps N] [--seed S]` times the bare walk: draw a
+// successor, touch its display text, restart at a random start on dead ends.
+// That is the memory access pattern of generation without the output, so it
+// is what --layout changes. Hardware counters come from perf_event_open for
+// this thread in user space; counters the kernel or VM does not expose are
+// reported as unavailable rather than guessed.
+
+struct hw_counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+  uint64_t value;
+};
+
+static void hw_counters_open(struct hw_counter *c, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = c[i].type;
+    attr.config = c[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c[i].fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    c[i].value = 0;
+  }
+}
+
+static void hw_counters_enable(struct hw_counter *c, size_t n, bool on) {
+  for (size_t i = 0; i < n; ++i) {
+    if (c[i].fd >= 0) ioctl(c[i].fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+  }
+}
+
+static void hw_counters_close(struct hw_counter *c, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (c[i].fd < 0) continue;
+    if (read(c[i].fd, &c[i].value, sizeof c[i].value) != (ssize_t)sizeof c[i].value) c[i].value = 0;
+    close(c[i].fd);
+  }
+}
+
+#define HW_CACHE(cache, op, result) \
+  ((uint64_t)(cache) | (uint64_t)(op) << 8 | (uint64_t)(result) << 16)
+
+static int cmd_bench(const struct model *m, int argc, char **argv) {
+  long steps = 10000000;
+  uint64_t seed = fresh_seed();
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) steps = atol(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+    else { fprintf(stderr, "bench: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (m->n_states == 0 || steps < 1) { fprintf(stderr, "bench: nothing to walk\n"); return 2; }
+
+  struct hw_counter hw[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0 },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0 },
+    { "cache references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0 },
+    { "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0 },
+    { "L1d load misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0 },
+    { "dTLB load misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0 },
+    { "page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, 0 },
+  };
+  size_t n_hw = sizeof hw / sizeof hw[0];
+  struct rng rng = { seed };
+  size_t v = random_token_id_that_starts_a_sentence(m, &rng), restarts = 0;
+  unsigned char sink = 0;
+  struct timespec t0, t1;
+  hw_counters_open(hw, n_hw);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  hw_counters_enable(hw, n_hw, true);
+  for (long i = 0; i < steps; ++i) {
+    struct state_hot h = m->hot[v];
+    if (h.n_occ == 0) {
+      v = random_token_id_that_starts_a_sentence(m, &rng);
+      ++restarts;
+      continue;
+    }
+    if (h.flags & STATE_FIXED) v = h.occ;
+    else v = m->occ_id ? m->occ_id[h.occ + rng_below(&rng, h.n_occ)] : temper_sample(m->sampler, v, &rng);
+    sink ^= (unsigned char)m->display[v][0];
+  }
+  hw_counters_enable(hw, n_hw, false);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  hw_counters_close(hw, n_hw);
+
+  double sec = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+  printf("steps\t%ld (%zu restarts, checksum %u)\n", steps, restarts, sink);
+  printf("time\t%.3f s, %.1f ns/step\n", sec, sec * 1e9 / (double)steps);
+  for (size_t i = 0; i < n_hw; ++i) {
+    if (hw[i].fd < 0) printf("%s\tunavailable\n", hw[i].name);
+    else printf("%s\t%llu (%.3f/step)\n", hw[i].name, (unsigned long long)hw[i].value, (double)hw[i].value / (double)steps);
+  }
+  return 0;
+}
+
+// --------------------------- N-gram export ---------------------------
+
+// `frankentext export FILE [--order K]` writes the n-gram counts as sorted
+// columns for external tools. Ids in the file are ranks in the byte-wise
+// sorted vocabulary, so rows sort the same way as their text, and two
+// exports can be merged as streams (see cmd_diff).
+//
+// File layout: struct ngram_header, then sections at the offsets it lists,
+// each starting on an NGRAM_ALIGN boundary so any column can be mapped by
+// itself:
+//   key_off  uint64[n_vocab + 1]  key i is text[key_off[i] .. key_off[i + 1] - 1), NUL-terminated
+//   text     the keys
+//   freq     uint32[n_vocab]      unigram counts
+//   col[j]   uint32[n_grams]      j-th token of each n-gram, for j < order
+//   count    uint32[n_grams]
+// N-grams are sorted by (col[0], ..., col[order - 1]), so for bigrams
+// col[0] is a run-length encoded CSR row index.
+#define NGRAM_MAGIC "FTNG0001"
+#define NGRAM_ALIGN 4096
+#define NGRAM_MAX_ORDER 8
+
+struct ngram_header {
+  char magic[8];
+  uint32_t order;
+  uint32_t tokenizer;  // index into tokenizers[]
+  uint32_t fold;
+  uint32_t reserved;
+  uint64_t n_vocab;
+  uint64_t n_grams;
+  uint64_t n_tokens;   // corpus length
+  uint64_t key_off, text, freq, count;
+  uint64_t col[NGRAM_MAX_ORDER];
+  uint64_t file_size;
+};
+
+static int cmp_key_rank(const void *a, const void *b, void *arg) {
+  const char *const *keys = (const char *const *)arg;
+  return strcmp(keys[*(const uint32_t *)a], keys[*(const uint32_t *)b]);
+}
+
+struct ngram_sort {
+  const uint32_t *rank_corpus; // corpus as vocabulary ranks
+  unsigned order;
+};
+
+static int cmp_ngram_pos(const void *a, const void *b, void *arg) {
+  const struct ngram_sort *s = (const struct ngram_sort *)arg;
+  const uint32_t *x = s->rank_corpus + *(const uint32_t *)a, *y = s->rank_corpus + *(const uint32_t *)b;
+  for (unsigned j = 0; j < s->order; ++j) {
+    if (x[j] != y[j]) return x[j] < y[j] ? -1 : 1;
+  }
+  return 0;
+}
+
+struct rank_count {
+  uint32_t rank, count;
+};
+
+static int cmp_rank_count(const void *a, const void *b) {
+  uint32_t x = ((const struct rank_count *)a)->rank, y = ((const struct rank_count *)b)->rank;
+  return (x > y) - (x < y);
+}
+
+static bool write_at(FILE *f, uint64_t off, const void *p, size_t bytes) {
+  return fseeko(f, (off_t)off, SEEK_SET) == 0 && fwrite(p, 1, bytes, f) == bytes;
+}
+
+static inline uint64_t ngram_align(uint64_t x) {
+  return (x + NGRAM_ALIGN - 1) & ~(uint64_t)(NGRAM_ALIGN - 1);
+}
+
+static int cmd_export(const struct model *m, int argc, char **argv) {
+  const char *path = NULL;
+  unsigned order = 2;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) order = (unsigned)atoi(argv[++i]);
+    else if (!path && argv[i][0] != '-') path = argv[i];
+    else { fprintf(stderr, "export: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (!path) { fprintf(stderr, "usage: frankentext export FILE [--order K]\n"); return 2; }
+  if (order < 1 || order > NGRAM_MAX_ORDER) { fprintf(stderr, "export: order must be 1..%d\n", NGRAM_MAX_ORDER); return 2; }
+  if (order != 2 && !m->corpus) { fprintf(stderr, "export: order %u needs the corpus, which a model snapshot does not keep\n", order); return 2; }
+  size_t n = m->n_states;
+
+  // Vocabulary in byte order: by_rank[r] is the id of rank r.
+  uint32_t *by_rank = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *rank = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  for (size_t v = 0; v < n; ++v) by_rank[v] = (uint32_t)v;
+  qsort_r(by_rank, n, sizeof(uint32_t), cmp_key_rank, m->tokens);
+  for (size_t r = 0; r < n; ++r) rank[by_rank[r]] = (uint32_t)r;
+
+  uint32_t *col[NGRAM_MAX_ORDER] = {0}, *count;
+  size_t grams = 0;
+  if (order == 2) {
+    // Straight from the CSR rows: visit the rows in rank order and sort each
+    // row's successors by rank.
+    size_t edges = m->row_off[n], widest = 0;
+    for (size_t v = 0; v < n; ++v) {
+      size_t k = m->row_off[v + 1] - m->row_off[v];
+      if (k > widest) widest = k;
+    }
+    col[0] = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+    col[1] = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+    count = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+    struct rank_count *row = (struct rank_count *)xmalloc((widest ? widest : 1) * sizeof *row);
+    for (size_t r = 0; r < n; ++r) {
+      size_t v = by_rank[r], lo = m->row_off[v], k = m->row_off[v + 1] - lo;
+      for (size_t j = 0; j < k; ++j) row[j] = (struct rank_count){ rank[m->succ_id[lo + j]], m->succ_count[lo + j] };
+      qsort(row, k, sizeof *row, cmp_rank_count);
+      for (size_t j = 0; j < k; ++j, ++grams) {
+        col[0][grams] = (uint32_t)r;
+        col[1][grams] = row[j].rank;
+        count[grams] = row[j].count;
+      }
+    }
+    free(row);
+  } else {
+    // Other orders: sort the corpus positions by the n-gram that starts there
+    // and count runs.
+    size_t windows = m->n_tokens >= order ? (size_t)m->n_tokens - order + 1 : 0;
+    uint32_t *rc = (uint32_t *)xmalloc((m->n_tokens ? m->n_tokens : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < m->n_tokens; ++i) rc[i] = rank[m->corpus[i]];
+    uint32_t *pos = (uint32_t *)xmalloc((windows ? windows : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < windows; ++i) pos[i] = (uint32_t)i;
+    struct ngram_sort ctx = { rc, order };
+    qsort_r(pos, windows, sizeof(uint32_t), cmp_ngram_pos, &ctx);
+    for (unsigned j = 0; j < order; ++j) col[j] = (uint32_t *)xmalloc((windows ? windows : 1) * sizeof(uint32_t));
+    count = (uint32_t *)xmalloc((windows ? windows : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < windows; ++i) {
+      if (i > 0 && cmp_ngram_pos(&pos[i - 1], &pos[i], &ctx) == 0) { count[grams - 1]++; continue; }
+      for (unsigned j = 0; j < order; ++j) col[j][grams] = rc[pos[i] + j];
+      count[grams++] = 1;
+    }
+    free(pos);
+    free(rc);
+  }
+
+  struct ngram_header hdr = { .order = order, .tokenizer = (uint32_t)(m->tok - tokenizers), .fold = m->fold,
+                              .n_vocab = n, .n_grams = grams, .n_tokens = m->n_tokens };
+  memcpy(hdr.magic, NGRAM_MAGIC, sizeof hdr.magic);
+  uint64_t text_bytes = 0;
+  uint64_t *key_off = (uint64_t *)xmalloc((n + 1) * sizeof(uint64_t));
+  uint32_t *freq = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  for (size_t r = 0; r < n; ++r) {
+    key_off[r] = text_bytes;
+    text_bytes += strlen(m->tokens[by_rank[r]]) + 1;
+    freq[r] = m->freq[by_rank[r]];
+  }
+  key_off[n] = text_bytes;
+  uint64_t at = ngram_align(sizeof hdr);
+  hdr.key_off = at; at = ngram_align(at + (n + 1) * sizeof(uint64_t));
+  hdr.text = at;    at = ngram_align(at + text_bytes);
+  hdr.freq = at;    at = ngram_align(at + n * sizeof(uint32_t));
+  for (unsigned j = 0; j < order; ++j) { hdr.col[j] = at; at = ngram_align(at + grams * sizeof(uint32_t)); }
+  hdr.count = at;
+  hdr.file_size = at + grams * sizeof(uint32_t);
+
+  FILE *f = fopen(path, "wb");
+  if (!f) { perror(path); return 1; }
+  bool ok = write_at(f, 0, &hdr, sizeof hdr) && write_at(f, hdr.key_off, key_off, (n + 1) * sizeof(uint64_t));
+  if (ok && fseeko(f, (off_t)hdr.text, SEEK_SET) != 0) ok = false;
+  for (size_t r = 0; ok && r < n; ++r) {
+    const char *k = m->tokens[by_rank[r]];
+    ok = fwrite(k, 1, strlen(k) + 1, f) == strlen(k) + 1;
+  }
+  ok = ok && write_at(f, hdr.freq, freq, n * sizeof(uint32_t));
+  for (unsigned j = 0; ok && j < order; ++j) ok = write_at(f, hdr.col[j], col[j], grams * sizeof(uint32_t));
+  ok = ok && write_at(f, hdr.count, count, grams * sizeof(uint32_t));
+  // Pad to the full size so the trailing section is complete even when empty.
+  ok = ok && ftruncate(fileno(f), (off_t)hdr.file_size) == 0;
+  if (fclose(f) != 0 || !ok) { perror(path); return 1; }
+  fprintf(stderr, "%zu %u-grams over %zu keys, %llu bytes\n", grams, order, n, (unsigned long long)hdr.file_size);
+
+  for (unsigned j = 0; j < order; ++j) free(col[j]);
+  free(count);
+  free(key_off);
+  free(freq);
+  free(by_rank);
+  free(rank);
+  return 0;
+}
+
+// --------------------------- Model diff ---------------------------
+
+// `frankentext diff OLD NEW` compares two bigram exports. Both vocabularies
+// are in byte order and both edge lists in (prev, next) rank order, so one
+// merge pass over each pairs up the keys, then the rows, then the successors
+// inside a row: linear time, no hashing, and the files are only mapped.
+
+struct ngram_file {
+  void *map;
+  size_t map_size;
+  const struct ngram_header *hdr;
+  const uint64_t *key_off;
+  const char *text;
+  const uint32_t *freq, *prev, *next, *count;
+};
+
+static bool open_ngram(const char *path, struct ngram_file *f) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); return false; }
+  f->map_size = (size_t)st.st_size;
+  f->map = f->map_size >= sizeof(struct ngram_header)
+             ? mmap(NULL, f->map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (f->map == MAP_FAILED) { fprintf(stderr, "%s: not an n-gram export\n", path); return false; }
+  const struct ngram_header *h = f->hdr = (const struct ngram_header *)f->map;
+  bool ok = memcmp(h->magic, NGRAM_MAGIC, sizeof h->magic) == 0 && h->file_size == f->map_size &&
+            h->key_off + (h->n_vocab + 1) * sizeof(uint64_t) <= f->map_size &&
+            h->freq + h->n_vocab * sizeof(uint32_t) <= f->map_size &&
+            h->count + h->n_grams * sizeof(uint32_t) <= f->map_size;
+  if (ok && h->order != 2) {
+    fprintf(stderr, "%s: diff needs a bigram export, not order %u\n", path, h->order);
+    munmap(f->map, f->map_size);
+    return false;
+  }
+  ok = ok && h->col[0] + h->n_grams * sizeof(uint32_t) <= f->map_size &&
+       h->col[1] + h->n_grams * sizeof(uint32_t) <= f->map_size;
+  if (ok) {
+    f->key_off = (const uint64_t *)((const char *)f->map + h->key_off);
+    ok = h->text + f->key_off[h->n_vocab] <= f->map_size;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: not an n-gram export\n", path);
+    munmap(f->map, f->map_size);
+    return false;
+  }
+  f->text = (const char *)f->map + h->text;
+  f->freq = (const uint32_t *)((const char *)f->map + h->freq);
+  f->prev = (const uint32_t *)((const char *)f->map + h->col[0]);
+  f->next = (const uint32_t *)((const char *)f->map + h->col[1]);
+  f->count = (const uint32_t *)((const char *)f->map + h->count);
+  return true;
+}
+
+static inline const char *ngram_key(const struct ngram_file *f, uint32_t r) {
+  return f->text + f->key_off[r];
+}
+
+// A state whose successor distribution moved. Ranked by the transition mass
+// that moved, tv * (old + new) / 2, so a hapax flipping its only successor
+// does not crowd out a frequent state drifting.
+struct shift_entry {
+  double moved, tv;
+  uint32_t old_rank, new_rank;
+};
+
+static int cmp_shift_moved(const void *a, const void *b) {
+  double x = ((const struct shift_entry *)a)->moved, y = ((const struct shift_entry *)b)->moved;
+  return (x > y) - (x < y);
+}
+
+static inline void shift_push(struct shift_entry *h, size_t *n, size_t cap, struct shift_entry e) {
+  heap_offer(h, n, cap, sizeof e, &e, cmp_shift_moved);
+}
+
+static int cmp_shift_desc(const void *a, const void *b) {
+  const struct shift_entry *x = (const struct shift_entry *)a, *y = (const struct shift_entry *)b;
+  if (x->moved != y->moved) return x->moved < y->moved ? 1 : -1;
+  return (x->old_rank > y->old_rank) - (x->old_rank < y->old_rank);
+}
+
+// Contribution of one point to JS(P || Q) in bits.
+static inline double js_term(double p, double q) {
+  double mid = 0.5 * (p + q), s = 0;
+  if (p > 0) s += p * log2(p / mid);
+  if (q > 0) s += q * log2(q / mid);
+  return 0.5 * s;
+}
+
+static void print_top_keys(const char *what, const struct ngram_file *f, struct top_entry *heap, size_t n, size_t total) {
+  qsort(heap, n, sizeof(struct top_entry), cmp_top_desc);
+  printf("%s\t%zu\n", what, total);
+  for (size_t i = 0; i < n; ++i) printf("  %u\t%s\n", heap[i].freq, ngram_key(f, heap[i].id));
+}
+
+static int cmd_diff(int argc, char **argv) {
+  const char *path[2] = {0};
+  size_t top = 20, n_paths = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = (size_t)atol(argv[++i]);
+    else if (n_paths < 2 && argv[i][0] != '-') path[n_paths++] = argv[i];
+    else { fprintf(stderr, "diff: unknown option %s\n", argv[i]); return 2; }
+  }
+  if (n_paths != 2) { fprintf(stderr, "usage: frankentext diff OLD NEW [--top N]\n"); return 2; }
+  struct ngram_file a, b;
+  if (!open_ngram(path[0], &a)) return 1;
+  if (!open_ngram(path[1], &b)) { munmap(a.map, a.map_size); return 1; }
+  if (a.hdr->tokenizer != b.hdr->tokenizer || a.hdr->fold != b.hdr->fold) {
+    fprintf(stderr, "diff: warning: exports were tokenized differently\n");
+  }
+  size_t na = a.hdr->n_vocab, nb = b.hdr->n_vocab;
+
+  // Pass 1: pair up the keys. Union ranks are monotone in both files, which
+  // is what lets pass 2 merge successor lists by comparing union ranks.
+  uint32_t *ua = (uint32_t *)xmalloc((na ? na : 1) * sizeof(uint32_t));
+  uint32_t *ub = (uint32_t *)xmalloc((nb ? nb : 1) * sizeof(uint32_t));
+  struct top_entry *added = (struct top_entry *)xmalloc((top ? top : 1) * sizeof(struct top_entry));
+  struct top_entry *removed = (struct top_entry *)xmalloc((top ? top : 1) * sizeof(struct top_entry));
+  size_t n_added = 0, n_removed = 0, added_n = 0, removed_n = 0, shared = 0;
+  uint64_t ta = 0, tb = 0;
+  for (size_t i = 0; i < na; ++i) ta += a.freq[i];
+  for (size_t j = 0; j < nb; ++j) tb += b.freq[j];
+  double uni_tv = 0, uni_js = 0;
+  uint32_t u = 0;
+  for (size_t i = 0, j = 0; i < na || j < nb; ++u) {
+    int c = i == na ? 1 : j == nb ? -1 : strcmp(ngram_key(&a, (uint32_t)i), ngram_key(&b, (uint32_t)j));
+    double p = c <= 0 && ta ? (double)a.freq[i] / (double)ta : 0, q = c >= 0 && tb ? (double)b.freq[j] / (double)tb : 0;
+    uni_tv += 0.5 * fabs(p - q);
+    uni_js += js_term(p, q);
+    if (c < 0) { top_push(removed, &removed_n, top, (struct top_entry){ a.freq[i], (uint32_t)i }); ++n_removed; }
+    else if (c > 0) { top_push(added, &added_n, top, (struct top_entry){ b.freq[j], (uint32_t)j }); ++n_added; }
+    else ++shared;
+    if (c <= 0) ua[i++] = u;
+    if (c >= 0) ub[j++] = u;
+  }
+
+  // Pass 2: walk both edge lists row by row in union order. Per shared state,
+  // the total variation between its successor distributions; overall, the
+  // distance between the two joint bigram distributions.
+  uint64_t ea = a.hdr->n_grams, eb = b.hdr->n_grams, ma = 0, mb = 0;
+  for (uint64_t e = 0; e < ea; ++e) ma += a.count[e];
+  for (uint64_t e = 0; e < eb; ++e) mb += b.count[e];
+  struct shift_entry *shifts = (struct shift_entry *)xmalloc((top ? top : 1) * sizeof(struct shift_entry));
+  size_t shifts_n = 0, rows_compared = 0, rows_changed = 0;
+  double joint_tv = 0, joint_js = 0, weighted_tv = 0, weight = 0;
+  uint64_t x = 0, y = 0, gained = 0, lost = 0;
+  for (size_t i = 0, j = 0; i < na || j < nb;) {
+    bool in_a = i < na && (j == nb || ua[i] <= ub[j]), in_b = j < nb && (i == na || ub[j] <= ua[i]);
+    uint64_t xa = x, yb = y, ra = 0, rb = 0;
+    while (in_a && x < ea && a.prev[x] == i) ra += a.count[x++];
+    while (in_b && y < eb && b.prev[y] == j) rb += b.count[y++];
+    double tv = 0;
+    uint64_t s = xa, t = yb;
+    while (s < x || t < y) {
+      int c = s == x ? 1 : t == y ? -1 : (ua[a.next[s]] > ub[b.next[t]]) - (ua[a.next[s]] < ub[b.next[t]]);
+      uint32_t ca = c <= 0 ? a.count[s++] : 0, cb = c >= 0 ? b.count[t++] : 0;
+      if (ca == 0) ++gained;
+      if (cb == 0) ++lost;
+      if (ra && rb) tv += 0.5 * fabs((double)ca / (double)ra - (double)cb / (double)rb);
+      double p = ma ? (double)ca / (double)ma : 0, q = mb ? (double)cb / (double)mb : 0;
+      joint_tv += 0.5 * fabs(p - q);
+      joint_js += js_term(p, q);
+    }
+    if (ra && rb) {
+      double w = 0.5 * ((double)ra / (double)ma + (double)rb / (double)mb);
+      ++rows_compared;
+      if (tv > 1e-12) {
+        ++rows_changed;
+        shift_push(shifts, &shifts_n, top, (struct shift_entry){ tv * 0.5 * (double)(ra + rb), tv, (uint32_t)i, (uint32_t)j });
+      }
+      weighted_tv += w * tv;
+      weight += w;
+    }
+    if (in_a) ++i;
+    if (in_b) ++j;
+  }
+
+  printf("tokens\t%llu -> %llu\n", (unsigned long long)a.hdr->n_tokens, (unsigned long long)b.hdr->n_tokens);
+  printf("vocabulary\t%zu -> %zu (%zu shared)\n", na, nb, shared);
+  printf("distinct bigrams\t%llu -> %llu (+%llu -%llu)\n", (unsigned long long)ea, (unsigned long long)eb,
+         (unsigned long long)gained, (unsigned long long)lost);
+  printf("unigram TV\t%.6f\n", uni_tv);
+  printf("unigram JS\t%.6f bits\n", uni_js);
+  printf("bigram TV\t%.6f\n", joint_tv);
+  printf("bigram JS\t%.6f bits\n", joint_js);
+  printf("states compared\t%zu (%zu changed)\n", rows_compared, rows_changed);
+  printf("mean successor TV\t%.6f\n", weight > 0 ? weighted_tv / weight : 0.0);
+  print_top_keys("added tokens", &b, added, added_n, n_added);
+  print_top_keys("removed tokens", &a, removed, removed_n, n_removed);
+  qsort(shifts, shifts_n, sizeof *shifts, cmp_shift_desc);
+  printf("largest shifts (TV, moved transitions):\n");
+  for (size_t k = 0; k < shifts_n; ++k) {
+    printf("  %.4f\t%.1f\t%s\n", shifts[k].tv, shifts[k].moved, ngram_key(&a, shifts[k].old_rank));
+  }
+
+  free(ua);
+  free(ub);
+  free(added);
+  free(removed);
+  free(shifts);
+  munmap(a.map, a.map_size);
+  munmap(b.map, b.map_size);
+  return 0;
+}
+
+// --------------------------- Vocabulary snapshots ---------------------------
+
+// Reads a text file and blanks non-printable bytes like the book loader.
+static char *load_text_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) { perror(path); exit(1); }
+  char *text = read_stream(f, len);
+  fclose(f);
+  text = (char *)xrealloc(text, *len + 1);
+  text[*len] = '\0';
+  for (size_t i = 0; i < *len; ++i) {
+    if (!isprint((unsigned char)text[i])) text[i] = ' ';
+  }
+  return text;
+}
+
+static int cmp_by_global(const void *a, const void *b, void *arg) {
+  const uint32_t *global = (const uint32_t *)arg;
+  uint32_t x = global[*(const uint32_t *)a], y = global[*(const uint32_t *)b];
+  return (x > y) - (x < y);
+}
+
+// Re-keys m against the shared vocabulary v: drops the model's own hash table
+// and, unless surface forms still need it (folded models), its key text.
+// False with a message when a key of m is missing from v.
+static bool share_vocab(struct model *m, const struct vocab *v) {
+  if (v->fold != m->fold || &tokenizers[v->tokenizer] != m->tok) {
+    fprintf(stderr, "vocabulary was built with a different tokenizer or folding\n");
+    return false;
+  }
+  m->global = (uint32_t *)xmalloc((m->n_states ? m->n_states : 1) * sizeof(uint32_t));
+  for (size_t id = 0; id < m->n_states; ++id) {
+    int64_t g = vocab_lookup(v, m->tokens[id], strlen(m->tokens[id]));
+    if (g < 0) {
+      fprintf(stderr, "token \"%s\" is not in the vocabulary\n", m->tokens[id]);
+      free(m->global);
+      m->global = NULL;
+      return false;
+    }
+    m->global[id] = (uint32_t)g;
+  }
+  m->by_global = (uint32_t *)xmalloc((m->n_states ? m->n_states : 1) * sizeof(uint32_t));
+  for (size_t id = 0; id < m->n_states; ++id) m->by_global[id] = (uint32_t)id;
+  qsort_r(m->by_global, m->n_states, sizeof(uint32_t), cmp_by_global, m->global);
+
+  for (size_t id = 0; id < m->n_states; ++id) {
+    if (!m->fold) m->display[id] = (char *)vocab_key(v, m->global[id]);
+    m->tokens[id] = (char *)vocab_key(v, m->global[id]);
+  }
+  if (!m->fold) arena_free(&m->pool);
+  free(m->hash_index);
+  m->hash_index = NULL;
+  m->vocab = v;
+  return true;
+}
+
+static bool open_vocab(const char *path, struct vocab *v) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); return false; }
+  v->map_size = (size_t)st.st_size;
+  v->map = v->map_size >= sizeof(struct vocab_header)
+             ? mmap(NULL, v->map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (v->map == MAP_FAILED) { fprintf(stderr, "%s: not a vocabulary snapshot\n", path); return false; }
+
+  const struct vocab_header *hdr = (const struct vocab_header *)v->map;
+  size_t tables = hdr->n * sizeof(uint64_t) + (hdr->n_buckets + hdr->table_size) * sizeof(uint32_t);
+  if (memcmp(hdr->magic, VOCAB_MAGIC, sizeof hdr->magic) != 0 ||
+      hdr->tokenizer >= sizeof tokenizers / sizeof tokenizers[0] ||
+      v->map_size != sizeof *hdr + tables + hdr->text_bytes) {
+    fprintf(stderr, "%s: not a vocabulary snapshot\n", path);
+    munmap(v->map, v->map_size);
+    return false;
+  }
+  v->fold = hdr->fold != 0;
+  v->tokenizer = hdr->tokenizer;
+  v->n = hdr->n;
+  v->n_buckets = hdr->n_buckets;
+  v->table_size = hdr->table_size;
+  v->key_off = (const uint64_t *)(hdr + 1);
+  v->disp = (const uint32_t *)(v->key_off + v->n);
+  v->slot = v->disp + v->n_buckets;
+  v->text = (const char *)(v->slot + v->table_size);
+  return true;
+}
+
+static void close_vocab(struct vocab *v) {
+  if (v->map) munmap(v->map, v->map_size);
+  memset(v, 0, sizeof *v);
+}
+
+// Finds a displacement for every bucket, largest buckets first, so that all
+// keys land in distinct slots. Returns false if some bucket exhausts the
+// displacement range (practically never at this load factor).
+static bool vocab_build_table(const uint64_t *h, size_t n, size_t n_buckets, size_t table_size,
+                              uint32_t *disp, uint32_t *slot) {
+  uint32_t *bucket_off = (uint32_t *)calloc(n_buckets + 1, sizeof(uint32_t));
+  uint32_t *member = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *order = (uint32_t *)xmalloc(n_buckets * sizeof(uint32_t));
+  if (!bucket_off) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (size_t i = 0; i < n; ++i) bucket_off[vocab_bucket(h[i], n_buckets) + 1]++;
+  for (size_t b = 0; b < n_buckets; ++b) bucket_off[b + 1] += bucket_off[b];
+  uint32_t *fill = (uint32_t *)xmalloc(n_buckets * sizeof(uint32_t));
+  memcpy(fill, bucket_off, n_buckets * sizeof(uint32_t));
+  for (size_t i = 0; i < n; ++i) member[fill[vocab_bucket(h[i], n_buckets)]++] = (uint32_t)i;
+  free(fill);
+
+  // Counting sort of the buckets by size, descending.
+  size_t largest = 0;
+  for (size_t b = 0; b < n_buckets; ++b) {
+    size_t k = bucket_off[b + 1] - bucket_off[b];
+    if (k > largest) largest = k;
+  }
+  uint32_t *by_size = (uint32_t *)calloc(largest + 2, sizeof(uint32_t));
+  if (!by_size) { fprintf(stderr, "OOM\n"); exit(1); }
+  for (size_t b = 0; b < n_buckets; ++b) by_size[largest - (bucket_off[b + 1] - bucket_off[b]) + 1]++;
+  for (size_t k = 0; k <= largest; ++k) by_size[k + 1] += by_size[k];
+  for (size_t b = 0; b < n_buckets; ++b) order[by_size[largest - (bucket_off[b + 1] - bucket_off[b])]++] = (uint32_t)b;
+  free(by_size);
+
+  memset(slot, 0xff, table_size * sizeof(uint32_t));
+  memset(disp, 0, n_buckets * sizeof(uint32_t));
+  size_t pos[64];
+  bool ok = true;
+  for (size_t oi = 0; oi < n_buckets && ok; ++oi) {
+    size_t b = order[oi], lo = bucket_off[b], k = bucket_off[b + 1] - lo;
+    if (k == 0) break;
+    if (k > 64) { ok = false; break; }
+    for (uint32_t d = 0;; ++d) {
+      if (d == UINT32_MAX) { ok = false; break; }
+      size_t j = 0;
+      for (; j < k; ++j) {
+        pos[j] = vocab_slot(h[member[lo + j]], d, table_size);
+        if (slot[pos[j]] != UINT32_MAX) break;
+        size_t e = 0;
+        while (e < j && pos[e] != pos[j]) ++e;
+        if (e < j) break;
+      }
+      if (j < k) continue;
+      for (j = 0; j < k; ++j) slot[pos[j]] = member[lo + j];
+      disp[b] = d;
+      break;
+    }
+  }
+  free(bucket_off);
+  free(member);
+  free(order);
+  return ok;
+}
+
+// frankentext vocab OUT FILE...: builds every model with the global options and
+// writes the union of their keys as a snapshot.
+static int cmd_vocab(const struct tokenizer *t, bool fold, int argc, char **argv) {
+  if (argc < 2) { fprintf(stderr, "usage: frankentext vocab OUT FILE...\n"); return 2; }
+  struct arena keys = {0};
+  char **key = NULL;
+  size_t n = 0, key_cap = 0, cap = 1 << 16;
+  uint32_t *set = (uint32_t *)xmalloc(cap * sizeof(uint32_t));
+  memset(set, 0xff, cap * sizeof(uint32_t));
+  bool folded = fold || t->fold;
+  for (int f = 1; f < argc; ++f) {
+    size_t len;
+    char *text = load_text_file(argv[f], &len);
+    struct model m = {0};
+    build_model_text(&m, t, fold, text, len);
+    free(text);
+    for (size_t id = 0; id < m.n_states; ++id) {
+      if (2 * (n + 1) > cap) {
+        // Grow and rehash the key set.
+        free(set);
+        cap *= 2;
+        set = (uint32_t *)xmalloc(cap * sizeof(uint32_t));
+        memset(set, 0xff, cap * sizeof(uint32_t));
+        for (size_t g = 0; g < n; ++g) {
+          size_t s = hash_str(key[g]) & (cap - 1);
+          while (set[s] != UINT32_MAX) s = (s + 1) & (cap - 1);
+          set[s] = (uint32_t)g;
+        }
+      }
+      size_t s = hash_str(m.tokens[id]) & (cap - 1);
+      while (set[s] != UINT32_MAX && strcmp(key[set[s]], m.tokens[id]) != 0) s = (s + 1) & (cap - 1);
+      if (set[s] != UINT32_MAX) continue;
+      if (n == key_cap) key = (char **)xrealloc(key, (key_cap = key_cap ? key_cap * 2 : 4096) * sizeof(char *));
+      key[n] = arena_strndup(&keys, m.tokens[id], strlen(m.tokens[id]));
+      set[s] = (uint32_t)n++;
+    }
+    fprintf(stderr, "%s: %zu states, vocabulary now %zu\n", argv[f], m.n_states, n);
+    free_model(&m);
+  }
+  free(set);
+  if (n >= UINT32_MAX) { fprintf(stderr, "vocab: too many keys\n"); return 1; }
+
+  uint64_t *h = (uint64_t *)xmalloc((n ? n : 1) * sizeof(uint64_t));
+  uint64_t *off = (uint64_t *)xmalloc((n ? n : 1) * sizeof(uint64_t));
+  uint64_t text_bytes = 0;
+  for (size_t g = 0; g < n; ++g) {
+    size_t len = strlen(key[g]);
+    h[g] = mix64(key_hash(folded, key[g], len));
+    off[g] = text_bytes;
+    text_bytes += len + 1;
+  }
+  size_t n_buckets = n / 4 + 1, table_size = n + n / 8 + 1;
+  uint32_t *disp = (uint32_t *)xmalloc(n_buckets * sizeof(uint32_t));
+  uint32_t *slot = (uint32_t *)xmalloc(table_size * sizeof(uint32_t));
+  if (!vocab_build_table(h, n, n_buckets, table_size, disp, slot)) {
+    fprintf(stderr, "vocab: could not build the perfect hash\n");
+    return 1;
+  }
+
+  struct vocab_header hdr = { .fold = folded, .tokenizer = (uint32_t)(t - tokenizers), .n = n,
+                              .n_buckets = n_buckets, .table_size = table_size, .text_bytes = text_bytes };
+  memcpy(hdr.magic, VOCAB_MAGIC, sizeof hdr.magic);
+  FILE *out = fopen(argv[0], "wb");
+  if (!out) { perror(argv[0]); return 1; }
+  bool ok = fwrite(&hdr, sizeof hdr, 1, out) == 1 &&
+            fwrite(off, sizeof(uint64_t), n, out) == n &&
+            fwrite(disp, sizeof(uint32_t), n_buckets, out) == n_buckets &&
+            fwrite(slot, sizeof(uint32_t), table_size, out) == table_size;
+  for (size_t g = 0; ok && g < n; ++g) ok = fwrite(key[g], 1, strlen(key[g]) + 1, out) == strlen(key[g]) + 1;
+  if (fclose(out) != 0 || !ok) { perror(argv[0]); return 1; }
+  fprintf(stderr, "%zu keys, %llu bytes of text, %zu slots\n", n, (unsigned long long)text_bytes, table_size);
+  free(h);
+  free(off);
+  free(disp);
+  free(slot);
+  free(key);
+  arena_free(&keys);
+  return 0;
+}
+
+// --------------------------- Model snapshots ---------------------------
+
+// `frankentext save FILE` writes the frozen model for `--model FILE`, which
+// maps it instead of reading the book. The mapping is not prefaulted, so a
+// process only pages in what it touches, and the layout makes that little:
+//   - states are renumbered by descending frequency, so the rows, keys and
+//     flags of the states walks actually visit sit together in the first
+//     pages of each section;
+//   - sections are page-aligned and ordered hot to cold;
+//   - the corpus and the per-occurrence rows are left out (they are as large
+//     as the corpus); rows are sampled through alias tables built on the
+//     first visit to each state (struct temper at T = 1), so cold states cost
+//     nothing until a walk reaches them.
+// What needs the corpus itself (--novel, index, match, export --order != 2)
+// is unavailable from a snapshot. `--residency` reports, per section, how
+// much of the mapping ended up resident after the command.
+//
+// File layout: struct snap_header, then the sections at the offsets it lists.
+#define SNAP_MAGIC "FTMOD002"
+#define SNAP_ALIGN 4096
+
+struct snap_header {
+  char magic[8];
+  uint32_t tokenizer;     // index into tokenizers[]
+  uint32_t fold;
+  uint64_t n_states, n_tokens, n_edges, n_forms;
+  uint64_t hot;           // struct state_hot[n_states]
+  uint64_t row_off;       // uint32[n_states + 1]
+  uint64_t occ_off;       // uint32[n_states + 1]: row totals as prefix sums
+  uint64_t freq;          // uint32[n_states]
+  uint64_t succ_id;       // uint32[n_edges]
+  uint64_t succ_count;    // uint32[n_edges]
+  uint64_t key_off;       // uint64[n_states + 1] into keys
+  uint64_t keys;          // NUL-terminated key text
+  uint64_t hash;          // int32[HASH_SIZE] open-addressing slots
+  uint64_t form_off;      // folded models: uint32[n_states + 1]
+  uint64_t form_key_off;  // uint64[n_forms + 1] into form_keys
+  uint64_t form_keys;
+  uint64_t form_initial;  // uint32[n_forms]
+  uint64_t form_other;    // uint32[n_forms]
+  uint64_t file_size;
+};
+
+struct snap_section {
+  const char *name;
+  uint64_t off, bytes;
+};
+
+// The sections of h in file order; returns how many there are.
+static size_t snap_sections(const struct snap_header *h, const uint64_t *key_off, const uint64_t *form_key_off,
+                            struct snap_section *s) {
+  size_t n = 0;
+  s[n++] = (struct snap_section){ "hot states", h->hot, h->n_states * sizeof(struct state_hot) };
+  s[n++] = (struct snap_section){ "row offsets", h->row_off, (h->n_states + 1) * sizeof(uint32_t) };
+  s[n++] = (struct snap_section){ "row totals", h->occ_off, (h->n_states + 1) * sizeof(uint32_t) };
+  s[n++] = (struct snap_section){ "frequencies", h->freq, h->n_states * sizeof(uint32_t) };
+  s[n++] = (struct snap_section){ "successors", h->succ_id, h->n_edges * sizeof(uint32_t) };
+  s[n++] = (struct snap_section){ "counts", h->succ_count, h->n_edges * sizeof(uint32_t) };
+  s[n++] = (struct snap_section){ "key offsets", h->key_off, (h->n_states + 1) * sizeof(uint64_t) };
+  s[n++] = (struct snap_section){ "keys", h->keys, key_off ? key_off[h->n_states] : 0 };
+  s[n++] = (struct snap_section){ "hash slots", h->hash, HASH_SIZE * sizeof(int32_t) };
+  if (h->fold) {
+    s[n++] = (struct snap_section){ "form offsets", h->form_off, (h->n_states + 1) * sizeof(uint32_t) };
+    s[n++] = (struct snap_section){ "form key offsets", h->form_key_off, (h->n_forms + 1) * sizeof(uint64_t) };
+    s[n++] = (struct snap_section){ "form keys", h->form_keys, form_key_off ? form_key_off[h->n_forms] : 0 };
+    s[n++] = (struct snap_section){ "form counts", h->form_initial, h->n_forms * sizeof(uint32_t) };
+    s[n++] = (struct snap_section){ "form counts", h->form_other, h->n_forms * sizeof(uint32_t) };
+  }
+  return n;
+}
+
+static inline uint64_t snap_align(uint64_t x) {
+  return (x + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+}
+
+static int cmd_save(const struct model *m, int argc, char **argv) {
+  if (argc != 1 || argv[0][0] == '-') { fprintf(stderr, "usage: frankentext save FILE\n"); return 2; }
+  if (m->vocab) { fprintf(stderr, "save: not supported with --vocab\n"); return 2; }
+  const char *path = argv[0];
+  size_t n = m->n_states, edges = m->row_off[n];
+
+  // Hot first: by_freq[r] is the state that becomes r.
+  uint32_t *by_freq = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *renum = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  for (size_t v = 0; v < n; ++v) by_freq[v] = (uint32_t)v;
+  qsort_r(by_freq, n, sizeof(uint32_t), cmp_freq_desc, m->freq);
+  for (size_t r = 0; r < n; ++r) renum[by_freq[r]] = (uint32_t)r;
+
+  uint32_t *row_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  uint32_t *occ_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+  struct state_hot *hot = (struct state_hot *)xmalloc((n ? n : 1) * sizeof(struct state_hot));
+  uint32_t *freq = (uint32_t *)xmalloc((n ? n : 1) * sizeof(uint32_t));
+  uint32_t *succ_id = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+  uint32_t *succ_count = (uint32_t *)xmalloc((edges ? edges : 1) * sizeof(uint32_t));
+  uint64_t *key_off = (uint64_t *)xmalloc((n + 1) * sizeof(uint64_t));
+  size_t widest = 0;
+  for (size_t v = 0; v < n; ++v) {
+    size_t k = m->row_off[v + 1] - m->row_off[v];
+    if (k > widest) widest = k;
+  }
+  struct rank_count *row = (struct rank_count *)xmalloc((widest ? widest : 1) * sizeof *row);
+  uint32_t e = 0, occ = 0;
+  uint64_t text = 0;
+  for (size_t r = 0; r < n; ++r) {
+    size_t v = by_freq[r], lo = m->row_off[v], k = m->row_off[v + 1] - lo;
+    row_off[r] = e;
+    occ_off[r] = occ;
+    hot[r] = m->hot[v];
+    hot[r].occ = hot[r].flags & STATE_FIXED ? renum[hot[r].occ] : occ;
+    hot[r].row = e;
+    occ += row_total(m, v);
+    freq[r] = m->freq[v];
+    key_off[r] = text;
+    text += strlen(m->tokens[v]) + 1;
+    // Rows stay sorted by (new) successor id.
+    for (size_t j = 0; j < k; ++j) row[j] = (struct rank_count){ renum[m->succ_id[lo + j]], m->succ_count[lo + j] };
+    qsort(row, k, sizeof *row, cmp_rank_count);
+    for (size_t j = 0; j < k; ++j, ++e) { succ_id[e] = row[j].rank; succ_count[e] = row[j].count; }
+  }
+  row_off[n] = e;
+  occ_off[n] = occ;
+  key_off[n] = text;
+  free(row);
+  int32_t *hash = (int32_t *)xmalloc(HASH_SIZE * sizeof(int32_t));
+  for (size_t i = 0; i < HASH_SIZE; ++i) hash[i] = m->hash_index[i] < 0 ? -1 : (int32_t)renum[m->hash_index[i]];
+
+  size_t n_forms = m->fold ? m->form_off[n] : 0;
+  uint32_t *form_off = NULL, *form_initial = NULL, *form_other = NULL;
+  uint64_t *form_key_off = NULL;
+  if (m->fold) {
+    form_off = (uint32_t *)xmalloc((n + 1) * sizeof(uint32_t));
+    form_key_off = (uint64_t *)xmalloc((n_forms + 1) * sizeof(uint64_t));
+    form_initial = (uint32_t *)xmalloc((n_forms ? n_forms : 1) * sizeof(uint32_t));
+    form_other = (uint32_t *)xmalloc((n_forms ? n_forms : 1) * sizeof(uint32_t));
+    uint32_t f = 0;
+    uint64_t bytes = 0;
+    for (size_t r = 0; r < n; ++r) {
+      size_t v = by_freq[r];
+      form_off[r] = f;
+      for (uint32_t j = m->form_off[v]; j < m->form_off[v + 1]; ++j, ++f) {
+        form_key_off[f] = bytes;
+        bytes += strlen(m->form_text[j]) + 1;
+        form_initial[f] = m->form_initial[j];
+        form_other[f] = m->form_other[j];
+      }
+    }
+    form_off[n] = f;
+    form_key_off[n_forms] = bytes;
+  }
+
+  struct snap_header hdr = { .tokenizer = (uint32_t)(m->tok - tokenizers), .fold = m->fold,
+                             .n_states = n, .n_tokens = m->n_tokens, .n_edges = edges, .n_forms = n_forms };
+  memcpy(hdr.magic, SNAP_MAGIC, sizeof hdr.magic);
+  uint64_t at = snap_align(sizeof hdr);
+  hdr.hot = at;          at = snap_align(at + n * sizeof(struct state_hot));
+  hdr.row_off = at;      at = snap_align(at + (n + 1) * sizeof(uint32_t));
+  hdr.occ_off = at;      at = snap_align(at + (n + 1) * sizeof(uint32_t));
+  hdr.freq = at;         at = snap_align(at + n * sizeof(uint32_t));
+  hdr.succ_id = at;      at = snap_align(at + edges * sizeof(uint32_t));
+  hdr.succ_count = at;   at = snap_align(at + edges * sizeof(uint32_t));
+  hdr.key_off = at;      at = snap_align(at + (n + 1) * sizeof(uint64_t));
+  hdr.keys = at;         at = snap_align(at + text);
+  hdr.hash = at;         at = at + HASH_SIZE * sizeof(int32_t);
+  if (m->fold) {
+    at = snap_align(at);
+    hdr.form_off = at;     at = snap_align(at + (n + 1) * sizeof(uint32_t));
+    hdr.form_key_off = at; at = snap_align(at + (n_forms + 1) * sizeof(uint64_t));
+    hdr.form_keys = at;    at = snap_align(at + form_key_off[n_forms]);
+    hdr.form_initial = at; at = snap_align(at + n_forms * sizeof(uint32_t));
+    hdr.form_other = at;   at = at + n_forms * sizeof(uint32_t);
+  }
+  hdr.file_size = at;
+
+  FILE *f = fopen(path, "wb");
+  if (!f) { perror(path); return 1; }
+  bool ok = write_at(f, 0, &hdr, sizeof hdr) &&
+            write_at(f, hdr.row_off, row_off, (n + 1) * sizeof(uint32_t)) &&
+            write_at(f, hdr.occ_off, occ_off, (n + 1) * sizeof(uint32_t)) &&
+            write_at(f, hdr.hot, hot, n * sizeof(struct state_hot)) &&
+            write_at(f, hdr.freq, freq, n * sizeof(uint32_t)) &&
+            write_at(f, hdr.succ_id, succ_id, edges * sizeof(uint32_t)) &&
+            write_at(f, hdr.succ_count, succ_count, edges * sizeof(uint32_t)) &&
+            write_at(f, hdr.key_off, key_off, (n + 1) * sizeof(uint64_t)) &&
+            write_at(f, hdr.hash, hash, HASH_SIZE * sizeof(int32_t));
+  if (ok && fseeko(f, (off_t)hdr.keys, SEEK_SET) != 0) ok = false;
+  for (size_t r = 0; ok && r < n; ++r) {
+    const char *k = m->tokens[by_freq[r]];
+    ok = fwrite(k, 1, strlen(k) + 1, f) == strlen(k) + 1;
+  }
+  if (ok && m->fold) {
+    ok = write_at(f, hdr.form_off, form_off, (n + 1) * sizeof(uint32_t)) &&
+         write_at(f, hdr.form_key_off, form_key_off, (n_forms + 1) * sizeof(uint64_t)) &&
+         write_at(f, hdr.form_initial, form_initial, n_forms * sizeof(uint32_t)) &&
+         write_at(f, hdr.form_other, form_other, n_forms * sizeof(uint32_t)) &&
+         fseeko(f, (off_t)hdr.form_keys, SEEK_SET) == 0;
+    for (size_t r = 0; ok && r < n; ++r) {
+      size_t v = by_freq[r];
+      for (uint32_t j = m->form_off[v]; ok && j < m->form_off[v + 1]; ++j) {
+        ok = fwrite(m->form_text[j], 1, strlen(m->form_text[j]) + 1, f) == strlen(m->form_text[j]) + 1;
+      }
+    }
+  }
+  ok = ok && ftruncate(fileno(f), (off_t)hdr.file_size) == 0;
+  if (fclose(f) != 0 || !ok) { perror(path); return 1; }
+  fprintf(stderr, "%zu states, %zu edges, %llu bytes\n", n, edges, (unsigned long long)hdr.file_size);
+
+  free(by_freq);
+  free(renum);
+  free(row_off);
+  free(occ_off);
+  free(hot);
+  free(freq);
+  free(succ_id);
+  free(succ_count);
+  free(key_off);
+  free(hash);
+  free(form_off);
+  free(form_key_off);
+  free(form_initial);
+  free(form_other);
+  return 0;
+}
+
+// Maps a snapshot into m. Only the key and form pointer tables are built up
+// front (reading the offset sections, not the text); nothing else is touched.
+// mincore reports the page cache, not this process, so `cold` first drops the
+// file's clean cached pages to make the residency report show this run's working set.
+static bool open_snapshot(const char *path, struct model *m, bool cold) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); return false; }
+  if (cold) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  size_t size = (size_t)st.st_size;
+  void *map = size >= sizeof(struct snap_header) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) { fprintf(stderr, "%s: not a model snapshot\n", path); return false; }
+  // Readahead would pull in cold neighbours of every hot page.
+  madvise(map, size, MADV_RANDOM);
+
+  const struct snap_header *h = (const struct snap_header *)map;
+  struct snap_section sec[16];
+  bool ok = memcmp(h->magic, SNAP_MAGIC, sizeof h->magic) == 0 && h->file_size == size &&
+            h->tokenizer < sizeof tokenizers / sizeof tokenizers[0] && h->n_states < UINT32_MAX;
+  size_t n_sec = ok ? snap_sections(h, NULL, NULL, sec) : 0;
+  for (size_t i = 0; ok && i < n_sec; ++i) ok = sec[i].off % SNAP_ALIGN == 0 && sec[i].off + sec[i].bytes <= size;
+  const uint64_t *key_off = ok ? (const uint64_t *)((const char *)map + h->key_off) : NULL;
+  const uint64_t *form_key_off = ok && h->fold ? (const uint64_t *)((const char *)map + h->form_key_off) : NULL;
+  ok = ok && h->keys + key_off[h->n_states] <= size &&
+       (!h->fold || h->form_keys + form_key_off[h->n_forms] <= size);
+  if (!ok) {
+    fprintf(stderr, "%s: not a model snapshot\n", path);
+    munmap(map, size);
+    return false;
+  }
+
+  const char *base = (const char *)map;
+  size_t n = h->n_states;
+  memset(m, 0, sizeof *m);
+  m->map = map;
+  m->map_size = size;
+  m->tok = &tokenizers[h->tokenizer];
+  m->fold = h->fold != 0;
+  m->n_states = n;
+  m->n_tokens = h->n_tokens;
+  m->row_off = (uint32_t *)(base + h->row_off);
+  m->occ_off = (uint32_t *)(base + h->occ_off);
+  m->hot = (struct state_hot *)(base + h->hot);
+  m->freq = (uint32_t *)(base + h->freq);
+  m->succ_id = (uint32_t *)(base + h->succ_id);
+  m->succ_count = (uint32_t *)(base + h->succ_count);
+  m->hash_index = (int *)(base + h->hash);
+  m->tokens = (char **)xmalloc((n ? n : 1) * sizeof(char *));
+  m->display = (char **)xmalloc((n ? n : 1) * sizeof(char *));
+  for (size_t i = 0; i < n; ++i) m->tokens[i] = m->display[i] = (char *)(base + h->keys + key_off[i]);
+  if (m->fold) {
+    m->form_off = (uint32_t *)(base + h->form_off);
+    m->form_initial = (uint32_t *)(base + h->form_initial);
+    m->form_other = (uint32_t *)(base + h->form_other);
+    m->form_text = (char **)xmalloc((h->n_forms ? h->n_forms : 1) * sizeof(char *));
+    for (size_t j = 0; j < h->n_forms; ++j) m->form_text[j] = (char *)(base + h->form_keys + form_key_off[j]);
+    // As in freeze_model: display the most frequent surface form.
+    for (size_t i = 0; i < n; ++i) {
+      if (m->form_off[i] < m->form_off[i + 1]) m->display[i] = m->form_text[m->form_off[i]];
+    }
+  }
+  m->sampler = (struct temper *)xmalloc(sizeof *m->sampler);
+  temper_init(m->sampler, m, 1.0, 1.0);
+  return true;
+}
+
+static void close_snapshot(struct model *m) {
+  temper_free(m->sampler);
+  free(m->sampler);
+  free(m->tokens);
+  free(m->display);
+  free(m->form_text);
+  munmap(m->map, m->map_size);
+  memset(m, 0, sizeof *m);
+}
+
+// Per section, the pages of the mapping that are resident now, then how much
+// of the walk the resident rows cover and what the lazy tables cost.
+static void report_residency(const struct model *m) {
+  const struct snap_header *h = (const struct snap_header *)m->map;
+  const char *base = (const char *)m->map;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = (m->map_size + page - 1) / page;
+  unsigned char *vec = (unsigned char *)xmalloc(pages ? pages : 1);
+  if (mincore(m->map, m->map_size, vec) != 0) { perror("mincore"); free(vec); return; }
+  struct snap_section sec[16];
+  size_t n_sec = snap_sections(h, (const uint64_t *)(base + h->key_off),
+                               h->fold ? (const uint64_t *)(base + h->form_key_off) : NULL, sec);
+  size_t all_in = 0;
+  for (size_t p = 0; p < pages; ++p) all_in += vec[p] & 1;
+  fprintf(stderr, "resident\t%zu of %zu pages (%.1f%%)\n", all_in, pages, pages ? 100.0 * all_in / pages : 0.0);
+  for (size_t i = 0; i < n_sec; ++i) {
+    if (sec[i].bytes == 0) continue;
+    size_t first = sec[i].off / page, last = (sec[i].off + sec[i].bytes - 1) / page, in = 0;
+    for (size_t p = first; p <= last; ++p) in += vec[p] & 1;
+    fprintf(stderr, "  %-16s\t%zu of %zu pages\n", sec[i].name, in, last - first + 1);
+  }
+
+  // A row is resident when every page of its successor ids is.
+  uint64_t covered = 0, total = m->occ_off[m->n_states];
+  size_t rows_in = 0, tables = 0;
+  uint64_t table_bytes = 0;
+  for (size_t v = 0; v < m->n_states; ++v) {
+    uint32_t lo = m->row_off[v], hi = m->row_off[v + 1];
+    if (lo == hi) continue;
+    size_t first = (h->succ_id + lo * sizeof(uint32_t)) / page, last = (h->succ_id + hi * sizeof(uint32_t) - 1) / page;
+    bool in = true;
+    for (size_t p = first; in && p <= last; ++p) in = vec[p] & 1;
+    if (in) { ++rows_in; covered += m->occ_off[v + 1] - m->occ_off[v]; }
+    const struct temper_row *row = atomic_load_explicit(&m->sampler->rows[v], memory_order_relaxed);
+    if (row) { ++tables; table_bytes += sizeof *row + row->n * sizeof(struct alias_slot); }
+  }
+  fprintf(stderr, "resident rows\t%zu of %zu states, %.1f%% of transitions\n", rows_in, m->n_states,
+          total ? 100.0 * (double)covered / (double)total : 0.0);
+  fprintf(stderr, "sampling tables\t%zu built, %llu bytes\n", tables, (unsigned long long)table_bytes);
+  free(vec);
+}
+
+// --------------------------- Model blending ---------------------------
+
+// Samples from a weighted mixture of independently built models without
+// merging them. States live in the union of the model vocabularies; every
+// model keeps a local->union and a union->local table, so a step is:
+// renormalize the weights over the models that have a non-empty row for the
+// current state, pick one, and draw an occurrence from its row in O(1).
+// That is exactly P(w | s) = sum_i w_i P_i(w | s) / sum_{i has s} w_i.
+struct blend {
+  size_t k;
+  struct model *models;
+  double *weight;       // normalized mixture weights
+  const struct vocab *vocab; // shared vocabulary the models were re-keyed to, or NULL
+  size_t n_union;
+  uint32_t **to_union;  // to_union[i][local id] -> union id
+  int32_t **to_local;   // to_local[i][union id] -> id in model i, or -1
+};
+
+// Interns every key of every model into the union vocabulary. Models re-keyed
+// against a shared vocabulary already carry global ids, which are used as is.
+static void blend_build_union(struct blend *b) {
+  b->to_union = (uint32_t **)xmalloc(b->k * sizeof(uint32_t *));
+  if (b->vocab) {
+    b->n_union = b->vocab->n;
+    for (size_t i = 0; i < b->k; ++i) b->to_union[i] = b->models[i].global;
+  } else {
+    size_t cap = 16, total = 0;
+    for (size_t i = 0; i < b->k; ++i) total += b->models[i].n_states;
+    while (cap < total * 2) cap <<= 1;
+    uint32_t *slots = (uint32_t *)xmalloc(cap * sizeof(uint32_t));
+    memset(slots, 0xff, cap * sizeof(uint32_t));
+    const char **key = (const char **)xmalloc((total ? total : 1) * sizeof(char *));
+    b->n_union = 0;
+    for (size_t i = 0; i < b->k; ++i) {
+      const struct model *m = &b->models[i];
+      b->to_union[i] = (uint32_t *)xmalloc((m->n_states ? m->n_states : 1) * sizeof(uint32_t));
+      for (size_t id = 0; id < m->n_states; ++id) {
+        size_t s = hash_str(m->tokens[id]) & (cap - 1);
+        while (slots[s] != UINT32_MAX && strcmp(key[slots[s]], m->tokens[id]) != 0) s = (s + 1) & (cap - 1);
+        if (slots[s] == UINT32_MAX) {
+          key[b->n_union] = m->tokens[id];
+          slots[s] = (uint32_t)b->n_union++;
+        }
+        b->to_union[i][id] = slots[s];
+      }
+    }
+    free(slots);
+    free(key);
+  }
+  b->to_local = (int32_t **)xmalloc(b->k * sizeof(int32_t *));
+  for (size_t i = 0; i < b->k; ++i) {
+    b->to_local[i] = (int32_t *)xmalloc((b->n_union ? b->n_union : 1) * sizeof(int32_t));
+    memset(b->to_local[i], 0xff, b->n_union * sizeof(int32_t));
+    for (size_t id = 0; id < b->models[i].n_states; ++id) b->to_local[i][b->to_union[i][id]] = (int32_t)id;
+  }
+}
+
+static void free_blend(struct blend *b) {
+  for (size_t i = 0; i < b->k; ++i) {
+    free_model(&b->models[i]);
+    if (b->to_union && !b->vocab) free(b->to_union[i]);
+    if (b->to_local) free(b->to_local[i]);
+  }
+  free(b->models);
+  free(b->weight);
+  free(b->to_union);
+  free(b->to_local);
+  memset(b, 0, sizeof *b);
+}
+
+// Index of the model to step with from union state u; SIZE_MAX if none has a row.
+static size_t blend_pick(const struct blend *b, size_t u, struct rng *rng) {
+  double w[b->k], total = 0.0;
+  for (size_t i = 0; i < b->k; ++i) {
+    int32_t l = u == SIZE_MAX ? 0 : b->to_local[i][u];
+    bool live = u == SIZE_MAX ? b->models[i].n_states > 0 : l >= 0 && row_total(&b->models[i], (size_t)l) > 0;
+    w[i] = live ? b->weight[i] : 0.0;
+    total += w[i];
+  }
+  if (total <= 0.0) return SIZE_MAX;
+  double r = rng_unit(rng) * total;
+  size_t last = SIZE_MAX;
+  for (size_t i = 0; i < b->k; ++i) {
+    if (w[i] <= 0.0) continue;
+    last = i;
+    if ((r -= w[i]) < 0.0) return i;
+  }
+  return last;
+}
+
+// The walker's per-step hook: picks the model that takes the next step from
+// the current state (or the first, before any token) and re-keys w->curr into
+// it, so the walk then draws from that model's row, and surface forms and
+// separators come from it. False, leaving w as is, when no model can step.
+static bool blend_enter(const struct blend *b, struct walker *w) {
+  size_t u = w->curr == SIZE_MAX ? SIZE_MAX : b->to_union[w->m - b->models][w->curr];
+  size_t i = blend_pick(b, u, &w->rng);
+  if (i == SIZE_MAX) return false;
+  w->m = &b->models[i];
+  if (u != SIZE_MAX) w->curr = (size_t)b->to_local[i][u];
+  return true;
+}
+
+// frankentext blend FILE[:WEIGHT]... [-n SENTENCES] [--seed S]
+static int cmd_blend(const struct tokenizer *t, bool fold, const struct vocab *v, int argc, char **argv) {
+  long count = 5;
+  uint64_t seed = fresh_seed();
+  struct blend b = { .vocab = v };
+  b.models = (struct model *)calloc((size_t)(argc ? argc : 1), sizeof(struct model));
+  if (!b.models) { fprintf(stderr, "OOM\n"); exit(1); }
+  b.weight = (double *)xmalloc((size_t)(argc ? argc : 1) * sizeof(double));
+  double total = 0.0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) { count = atol(argv[++i]); continue; }
+    if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { seed = strtoull(argv[++i], NULL, 0); continue; }
+    if (argv[i][0] == '-') { fprintf(stderr, "blend: unknown option %s\n", argv[i]); free_blend(&b); return 2; }
+    // FILE:WEIGHT, where a colon not followed by a number is part of the name.
+    char *colon = strrchr(argv[i], ':');
+    char *end = NULL;
+    double w = colon ? strtod(colon + 1, &end) : 1.0;
+    if (colon && (end == colon + 1 || *end != '\0')) { w = 1.0; colon = NULL; }
+    if (colon) *colon = '\0';
+    if (!(w > 0.0)) { fprintf(stderr, "blend: weight of %s must be positive\n", argv[i]); free_blend(&b); return 2; }
+    size_t len;
+    char *text = load_text_file(argv[i], &len);
+    build_model_text(&b.models[b.k], t, fold, text, len);
+    free(text);
+    if (v && !share_vocab(&b.models[b.k], v)) {
+      free_model(&b.models[b.k]);
+      free_blend(&b);
+      return 1;
+    }
+    prerender_model(&b.models[b.k]);
+    fprintf(stderr, "%s: %zu states, weight %g\n", argv[i], b.models[b.k].n_states, w);
+    b.weight[b.k++] = w;
+    total += w;
+  }
+  if (b.k == 0) {
+    fprintf(stderr, "usage: frankentext blend FILE[:WEIGHT]... [-n SENTENCES] [--seed S]\n");
+    free_blend(&b);
+    return 2;
+  }
+  for (size_t i = 0; i < b.k; ++i) b.weight[i] /= total;
+  blend_build_union(&b);
+  fprintf(stderr, "union vocabulary: %zu states\n", b.n_union);
+
+  struct gen_params gp = { .blend = &b };
+  struct rng rng = { mix64(seed) };
+  char buf[4096];
+  long written = 0;
+  for (long i = 0; i < count; ++i) {
+    struct walker walk;
+    enum walk_status st = WALK_END;
+    for (int tries = 0; tries < GEN_TRIES; ++tries) {
+      walker_start(&walk, &b.models[0], &gp, rng, SIZE_MAX, NULL, sizeof buf);
+      st = walk_render(&walk, buf, sizeof buf);
+      rng = walk.rng;
+      if (st == WALK_END) break;
+    }
+    if (st != WALK_END) continue;
+    puts(buf);
+    ++written;
+  }
+  free_blend(&b);
+  if (written < count) {
+    fprintf(stderr, "blend: only %ld of %ld sentences written\n", written, count);
+    return 1;
+  }
+  return 0;
+}
+
+// --------------------------- Main ---------------------------
+
+static void usage(void);
+
+static void build_model(struct model *m, const struct tokenizer *t, bool fold) {
+  load_book();
+  build_model_text(m, t, fold, book_mut, strlen(book_mut));
+
+  // Token text is interned, so the book is no longer needed.
+  release_book();
+}
+
+// Generate a question sentence and an exclamation sentence.
+// Options: --novel L rejects sentences that copy more than L corpus tokens in a row.
+//          --min-words N / --max-words N condition each sentence on its length.
+static int cmd_sentences(const struct model *m, int argc, char **argv) {
+  struct gen_params gp = {0};
+  struct novelty_index novel = {0};
+  long min_words = 0, max_words = 0;
+  double temperature = 1.0, top_p = 1.0;
+  for (int i = 0; i < argc; ++i) {
+    if (parse_temper_option(argc, argv, &i, &temperature, &top_p)) {
+      continue;
+    } else if (strcmp(argv[i], "--novel") == 0 && i + 1 < argc) {
+      int max_copy = atoi(argv[++i]);
+      if (max_copy < 1) { fprintf(stderr, "--novel needs a span of at least 1 token\n"); return 2; }
+      build_novelty_index(m, (size_t)max_copy, &novel);
+      gp.novel = &novel;
+    } else if (strcmp(argv[i], "--min-words") == 0 && i + 1 < argc) {
+      min_words = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--max-words") == 0 && i + 1 < argc) {
+      max_words = atol(argv[++i]);
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  bool conditioned = min_words > 0 || max_words > 0;
+  if (conditioned) {
+    if (min_words < 1) min_words = 1;
+    if (max_words == 0) max_words = min_words > 64 ? min_words : 64;
+    if (max_words < min_words || max_words > MAX_LENGTH_CONDITION) {
+      fprintf(stderr, "--min-words/--max-words must satisfy 1 <= min <= max <= %d\n", MAX_LENGTH_CONDITION);
+      return 2;
+    }
+  }
+  struct temper temper = {0};
+  if (temperature != 1.0 || top_p < 1.0) {
+    if (conditioned) { fprintf(stderr, "--temperature/--top-p cannot be combined with --min-words/--max-words\n"); return 2; }
+    temper_init(&temper, m, temperature, top_p);
+    gp.temper = &temper;
+  }
+  struct length_dp question, exclamation;
+  if (conditioned) {
+    length_dp_init(&question, m, (size_t)min_words, (size_t)max_words, "?");
+    length_dp_init(&exclamation, m, (size_t)min_words, (size_t)max_words, "!");
+  }
+
+  // Keep sampling until the final char matches the desired punctuation.
+  char buf[4096];
+  struct rng rng = { fresh_seed() };
+
+  // Question
+  if (conditioned) gp.length = &question;
+  for (int tries = 0; tries < 1000; ++tries) {
+    generate_sentence(m, &gp, &rng, SIZE_MAX, buf, sizeof buf, NULL);
+    if (ends_with_char(buf, '?')) {
+      printf("%s\n\n", buf);
+      break;
+    }
+  }
+
+  // Exclamation
+  if (conditioned) gp.length = &exclamation;
+  for (int tries = 0; tries < 1000; ++tries) {
+    generate_sentence(m, &gp, &rng, SIZE_MAX, buf, sizeof buf, NULL);
+    if (ends_with_char(buf, '!')) {
+      printf("%s\n", buf);
+      break;
+    }
+  }
+
+  if (conditioned) {
+    length_dp_free(&question);
+    length_dp_free(&exclamation);
+  }
+  temper_free(&temper);
+  free_novelty_index(&novel);
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: frankentext [--tokenizer whitespace|punct|fold|char] [--fold] [--layout corpus|bfs] [--vocab FILE]\n"
+          "                   [--model FILE [--residency]] COMMAND ...\n"
+          "\n"
+          "       frankentext [--novel L] [--min-words N] [--max-words N] [--temperature T] [--top-p P]\n"
+          "                                         generate a question and an exclamation\n"
+          "       frankentext score [SENTENCE...]   log-probability per sentence (stdin if none)\n"
+          "       frankentext perplexity [-j N] FILE...\n"
+          "       frankentext index FILE            write a suffix array over the corpus\n"
+          "       frankentext match FILE [SENTENCE...]  longest corpus match per sentence\n"
+          "       frankentext beam [-b B] [-n MAX] [--end CHARS] [--start WORD]\n"
+          "       frankentext chars [-n ORDER] [--words K | --sentences K] [--bench STEPS]\n"
+          "       frankentext doc [-d DOCS] [-p PARAGRAPHS] [-k SENTENCES] [-j N] [--seed S] [--novel L]\n"
+          "                       [--temperature T] [--top-p P]\n"
+          "       frankentext gen [-n COUNT] [-j N] [--unique] [--format text|jsonl] [-o FILE [--direct|--mmap]]\n"
+          "                       [--seed S] [--novel L] [--temperature T] [--top-p P]\n"
+          "       frankentext serve [--port P]  stream GET /?n=SENTENCES&seed=S token by token\n"
+          "       frankentext blend FILE[:WEIGHT]... [-n SENTENCES] [--seed S]\n"
+          "       frankentext vocab OUT FILE...     write a shared vocabulary snapshot for --vocab\n"
+          "       frankentext chain [-j N] [--iters K] [--tol E] [--top K]  stationary distribution, entropy, lengths\n"
+          "       frankentext stats [-j N] [--top N]  corpus and model statistics\n"
+          "       frankentext bench [--steps N] [--seed S]  time the bare walk, with hardware counters\n"
+          "       frankentext save FILE             write a model snapshot for --model\n"
+          "       frankentext export FILE [--order K]  sorted columnar n-gram counts\n"
+          "       frankentext diff OLD NEW [--top N]  compare two bigram exports\n");
+}
+
+int main(int argc, char **argv) {
+  // Global options come before the command.
+  const struct tokenizer *tok = &tokenizers[0];
+  bool fold = false;
+  const char *vocab_path = NULL, *model_path = NULL;
+  bool residency = false;
+  for (;;) {
+    if (argc > 2 && strcmp(argv[1], "--tokenizer") == 0) {
+      tok = find_tokenizer(argv[2]);
+      if (!tok) { fprintf(stderr, "unknown tokenizer %s\n", argv[2]); return 2; }
+      argv[2] = argv[0];
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 2 && strcmp(argv[1], "--vocab") == 0) {
+      vocab_path = argv[2];
+      argv[2] = argv[0];
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 2 && strcmp(argv[1], "--model") == 0) {
+      model_path = argv[2];
+      argv[2] = argv[0];
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 2 && strcmp(argv[1], "--layout") == 0) {
+      if (strcmp(argv[2], "bfs") == 0) bfs_layout = true;
+      else if (strcmp(argv[2], "corpus") == 0) bfs_layout = false;
+      else { fprintf(stderr, "unknown layout %s\n", argv[2]); return 2; }
+      argv[2] = argv[0];
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 1 && strcmp(argv[1], "--residency") == 0) {
+      residency = true;
+      argv[1] = argv[0];
+      argc -= 1;
+      argv += 1;
+    } else if (argc > 1 && strcmp(argv[1], "--fold") == 0) {
+      fold = true;
+      argv[1] = argv[0];
+      argc -= 1;
+      argv += 1;
+    } else {
+      break;
+    }
+  }
+
+  if (argc > 1 && (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)) {
+    usage();
+    return 0;
+  }
+  // The character model shares only the loader and sanitizer.
+  if (argc > 1 && strcmp(argv[1], "chars") == 0) return cmd_chars(argc - 2, argv + 2);
+  // Diff reads two exports and never looks at the corpus.
+  if (argc > 1 && strcmp(argv[1], "diff") == 0) return cmd_diff(argc - 2, argv + 2);
+  // The vocabulary is built from the files it is given, not from the book.
+  if (argc > 1 && strcmp(argv[1], "vocab") == 0) return cmd_vocab(tok, fold, argc - 2, argv + 2);
+  struct vocab shared = {0};
+  if (vocab_path && !open_vocab(vocab_path, &shared)) return 1;
+  // Blending builds its own models from the files it is given.
+  if (argc > 1 && strcmp(argv[1], "blend") == 0) {
+    int rc = cmd_blend(tok, fold, vocab_path ? &shared : NULL, argc - 2, argv + 2);
+    close_vocab(&shared);
+    return rc;
+  }
+
+  if (model_path) {
+    if (vocab_path) { fprintf(stderr, "--model and --vocab cannot be combined\n"); return 2; }
+    if (argc > 1 && (strcmp(argv[1], "index") == 0 || strcmp(argv[1], "match") == 0)) {
+      fprintf(stderr, "%s needs the corpus, which a model snapshot does not keep\n", argv[1]);
+      return 2;
+    }
+    if (!open_snapshot(model_path, &model, residency)) return 1;
+  } else {
+    if (residency) { fprintf(stderr, "--residency needs --model\n"); return 2; }
+    build_model(&model, tok, fold);
+    if (vocab_path && !share_vocab(&model, &shared)) return 1;
+    prerender_model(&model);
+  }
+
+  int rc;
+  if (argc < 2 || argv[1][0] == '-') {
+    rc = cmd_sentences(&model, argc - 1, argv + 1);
+  } else if (strcmp(argv[1], "score") == 0) {
+    rc = cmd_score(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "perplexity") == 0) {
+    rc = cmd_perplexity(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "index") == 0) {
+    rc = cmd_index(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "match") == 0) {
+    rc = cmd_match(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "beam") == 0) {
+    rc = cmd_beam(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "doc") == 0) {
+    rc = cmd_doc(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "gen") == 0) {
+    rc = cmd_gen(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "bench") == 0) {
+    rc = cmd_bench(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "save") == 0) {
+    rc = cmd_save(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "export") == 0) {
+    rc = cmd_export(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "stats") == 0) {
+    rc = cmd_stats(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "chain") == 0) {
+    rc = cmd_chain(&model, argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "serve") == 0) {
+    rc = cmd_serve(&model, argc - 2, argv + 2);
+  } else {
+    usage();
+    rc = 2;
+  }
+
+  if (residency) report_residency(&model);
+
+  // Cleanup (optional in short-lived program)
+  if (model.map) close_snapshot(&model);
+  else free_model(&model);
+  close_vocab(&shared);
+
+  return rc;
 }